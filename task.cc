@@ -1,17 +1,42 @@
+#include <algorithm>
 #include <atomic>
+#include <bit>
 #include <cassert>
+#include <charconv>
 #include <chrono>
+#include <concepts>
 #include <condition_variable>
+#include <csignal>
+#include <cerrno>
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <exception>
 #include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
 #include <limits>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <ranges>
+#include <span>
+#include <sstream>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <unistd.h> // for fsync()
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <utility>
 #include <vector>
 
@@ -23,351 +48,5508 @@ constexpr unsigned long long operator"" _KB(unsigned long long num)
     return num * 1024;
 }
 
-int GetFileDescriptor(std::filebuf& filebuf)
+/**
+ * Write all of `iov` to `fd`, continuing after short writes. Non-zero
+ * `flags` are passed to `pwritev2`, e.g. `RWF_DSYNC`.
+ */
+bool write_all(int fd, iovec* iov, int count, int flags = 0)
 {
-    class my_filebuf : public std::filebuf
+    while (count > 0)
     {
-    public:
-        int handle() { return _M_file.fd(); }
-    };
-
-    // UBSan throw error because of downcasting.
-    return static_cast<my_filebuf&>(filebuf).handle();
+        auto written = flags ? ::pwritev2(fd, iov, count, -1, flags)
+                             : ::writev(fd, iov, count);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        while (count > 0 && std::size_t(written) >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
+    }
+    return true;
 }
 
-int GetFileDescriptor(std::ofstream& ofs)
+/**
+ * `write_all` for a socket without raising SIGPIPE when the peer is gone;
+ * other file descriptors are written as usual.
+ */
+bool send_all(int fd, iovec* iov, int count)
 {
-    return GetFileDescriptor(*ofs.rdbuf());
+    while (count > 0)
+    {
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        auto sent = ::sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == ENOTSOCK)
+            return write_all(fd, iov, count);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        while (count > 0 && std::size_t(sent) >= iov->iov_len)
+        {
+            sent -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + sent;
+            iov->iov_len -= sent;
+        }
+    }
+    return true;
 }
 
-template <typename T> T pad_to_multiple_of_8(T value)
+/**
+ * Input stream buffer over a socket or pipe. Calls `idle()` whenever it
+ * has consumed everything that arrived so far and is about to block.
+ */
+class fd_streambuf : public std::streambuf
+{
+public:
+    fd_streambuf(int fd, std::function<void()> idle)
+        : m_fd(fd), m_idle(std::move(idle))
+    {
+    }
+
+protected:
+    int_type underflow() override
+    {
+        auto ready = pollfd{.fd = m_fd, .events = POLLIN, .revents = 0};
+        if (::poll(&ready, 1, 0) == 0)
+            m_idle();
+
+        ssize_t n;
+        do
+            n = ::read(m_fd, m_buffer, sizeof(m_buffer));
+        while (n < 0 && errno == EINTR);
+        if (n <= 0)
+            return traits_type::eof();
+        setg(m_buffer, m_buffer, m_buffer + n);
+        return traits_type::to_int_type(m_buffer[0]);
+    }
+
+private:
+    int m_fd;
+    std::function<void()> m_idle;
+    char m_buffer[64_KB];
+};
+
+template <std::size_t N, typename T> T pad_to_multiple_of(T value)
 {
-    return (value + 7) & ~7;
+    static_assert(std::has_single_bit(N));
+    return (value + (N - 1)) & ~T(N - 1);
 }
 
 /**
- * Persistent vector implementation.
+ * Epoch based reclamation.
+ *
+ * Readers `pin()` the domain while they follow pointers to shared objects;
+ * the single writer `retire()`s objects it unlinked and they are only freed
+ * once every reader that could still see them has unpinned.
  */
-class vector
+class epoch_domain
 {
-    struct alignas(8) Item
+    static constexpr std::size_t _slots = 128;
+    static constexpr std::size_t _batch = 64;
+    static constexpr uint64_t _idle = std::numeric_limits<uint64_t>::max();
+
+    struct alignas(64) Slot
     {
-        uint64_t id;
-        std::string str;
-        // std::stringstream oss;
+        std::atomic<uint64_t> epoch{_idle};
+    };
 
-        template <typename T>
-        Item(uint64_t id, T&& str) : id{id}, str{std::forward<T>(str)}
+public:
+    /**
+     * Keeps everything retired after its creation alive.
+     */
+    class guard
+    {
+    public:
+        guard() = default;
+        explicit guard(const epoch_domain& domain) : m_slot(&domain.enter()) {}
+        guard(guard&& g) noexcept : m_slot(std::exchange(g.m_slot, nullptr))
+        {
+        }
+        guard& operator=(guard&& g) noexcept
+        {
+            std::swap(m_slot, g.m_slot);
+            return *this;
+        }
+        ~guard()
         {
+            if (m_slot)
+                m_slot->epoch.store(_idle, std::memory_order_release);
         }
-        Item(const Item&) = default;
-        Item(Item&&) = default;
-        Item& operator=(const Item&) = default;
-        Item& operator=(Item&&) = default;
+
+    private:
+        Slot* m_slot = nullptr;
     };
 
-    struct Header
+    epoch_domain() = default;
+    epoch_domain(const epoch_domain&) = delete;
+    epoch_domain& operator=(const epoch_domain&) = delete;
+    ~epoch_domain()
     {
-        uint64_t type;
-        uint64_t id;
-        union
+        for (auto& [epoch, deleter] : m_retired)
+            deleter();
+    }
+
+    guard pin() const { return guard(*this); }
+
+    /**
+     * Run `deleter` once no reader can still see the object it frees. The
+     * object must already be unreachable for new readers.
+     */
+    void retire(std::function<void()> deleter)
+    {
+        m_retired.emplace_back(m_epoch.fetch_add(1), std::move(deleter));
+        if (m_retired.size() >= _batch)
+            collect();
+    }
+
+    /**
+     * Free every retired object that no pinned reader can still see.
+     */
+    void collect()
+    {
+        auto oldest = _idle;
+        for (auto& slot : m_slots)
+            oldest = std::min(oldest, slot.epoch.load());
+
+        auto it = std::stable_partition(
+            m_retired.begin(), m_retired.end(),
+            [&](auto& r) { return r.first >= oldest; });
+        for (auto freed = it; freed != m_retired.end(); ++freed)
+            freed->second();
+        m_retired.erase(it, m_retired.end());
+    }
+
+private:
+    std::atomic<uint64_t> m_epoch{0};
+    mutable Slot m_slots[_slots];
+    std::vector<std::pair<uint64_t, std::function<void()>>> m_retired;
+
+    Slot& enter() const
+    {
+        thread_local std::size_t hint =
+            std::hash<std::thread::id>{}(std::this_thread::get_id());
+        for (auto i = hint;; ++i)
         {
-            uint64_t dsize;
-            uint64_t rindex;
-        };
+            auto& slot = m_slots[i % _slots];
+            auto expected = _idle;
+            if (slot.epoch.load(std::memory_order_relaxed) == _idle &&
+                slot.epoch.compare_exchange_strong(expected, m_epoch.load()))
+            {
+                hint = i;
+                return slot;
+            }
+        }
+    }
+};
+
+/**
+ * Lets any number of appenders in at once, or one exclusive section.
+ *
+ * A waiting exclusive section holds new appenders back, so a steady stream of
+ * appends cannot starve it.
+ */
+class append_gate
+{
+    static constexpr uint64_t _exclusive = uint64_t(1) << 63;
+
+public:
+    class shared_lock
+    {
+    public:
+        explicit shared_lock(append_gate& gate) : m_gate(gate)
+        {
+            m_gate.lock_shared();
+        }
+        ~shared_lock() { m_gate.unlock_shared(); }
+        shared_lock(const shared_lock&) = delete;
+        shared_lock& operator=(const shared_lock&) = delete;
+
+    private:
+        append_gate& m_gate;
+    };
+
+    class unique_lock
+    {
+    public:
+        explicit unique_lock(append_gate& gate) : m_gate(gate)
+        {
+            m_gate.lock();
+        }
+        ~unique_lock() { m_gate.unlock(); }
+        unique_lock(const unique_lock&) = delete;
+        unique_lock& operator=(const unique_lock&) = delete;
+
+    private:
+        append_gate& m_gate;
+    };
+
+    void lock_shared()
+    {
+        while (true)
+        {
+            auto state = m_state.fetch_add(1, std::memory_order_acquire);
+            if (!(state & _exclusive))
+                return;
+            unlock_shared();
+            while ((state = m_state.load()) & _exclusive)
+                m_state.wait(state);
+        }
+    }
+
+    void unlock_shared()
+    {
+        if (m_state.fetch_sub(1, std::memory_order_release) - 1 == _exclusive)
+            m_state.notify_all();
+    }
+
+    void lock()
+    {
+        m_exclusive_mtx.lock();
+        auto state = m_state.fetch_or(_exclusive, std::memory_order_acquire);
+        while ((state & ~_exclusive) != 0)
+        {
+            m_state.wait(state | _exclusive);
+            state = m_state.load(std::memory_order_acquire);
+        }
+    }
+
+    void unlock()
+    {
+        m_state.fetch_and(~_exclusive, std::memory_order_release);
+        m_state.notify_all();
+        m_exclusive_mtx.unlock();
+    }
+
+    /**
+     * Held by every exclusive section; locking it alone excludes those but
+     * lets appenders in.
+     */
+    std::mutex& sections() { return m_exclusive_mtx; }
+
+private:
+    // Number of appenders inside, plus `_exclusive` while a section waits or
+    // runs.
+    std::atomic<uint64_t> m_state = 0;
+    std::mutex m_exclusive_mtx;
+};
+
+/**
+ * Bounded multi-producer single-consumer staging ring for log records.
+ *
+ * Every record owns a ticket from one shared counter and lives in entry
+ * `ticket % _capacity`, so the consumer writes records in ticket order no
+ * matter in which order the producers finished copying them. Producers only
+ * touch their own entry and never wait for each other unless the ring is
+ * full.
+ */
+class record_ring
+{
+    static constexpr std::size_t _capacity = 256;
+
+    struct alignas(64) Entry
+    {
+        // `ticket` while free for `ticket`, `ticket + 1` once it holds it.
+        std::atomic<uint64_t> seq;
+        std::size_t length = 0;
+        std::size_t capacity = 0;
+        std::unique_ptr<char[]> data;
     };
 
 public:
+    explicit record_ring(uint64_t first_ticket) { reset(first_ticket); }
+
     /**
-     * Create a new vector that can be persistent to `directory`.
+     * Forget every staged record and start over at `first_ticket`. Not safe
+     * while producers or the consumer are running.
+     */
+    void reset(uint64_t first_ticket)
+    {
+        for (auto t = first_ticket; t < first_ticket + _capacity; ++t)
+            entry(t).seq.store(t, std::memory_order_relaxed);
+        m_next.store(first_ticket, std::memory_order_relaxed);
+    }
+
+    /**
+     * Copy the concatenation of `parts` into the entry of `ticket`. Fails if
+     * the record `_capacity` tickets earlier has not been drained yet.
+     */
+    bool try_stage(uint64_t ticket,
+                   std::initializer_list<std::string_view> parts)
+    {
+        auto& e = entry(ticket);
+        if (e.seq.load(std::memory_order_acquire) != ticket)
+            return false;
+
+        std::size_t length = 0;
+        for (auto part : parts)
+            length += part.size();
+        if (length > e.capacity)
+        {
+            e.data = std::make_unique_for_overwrite<char[]>(length);
+            e.capacity = length;
+        }
+        auto* out = e.data.get();
+        for (auto part : parts)
+            out = std::copy(part.begin(), part.end(), out);
+        e.length = length;
+
+        e.seq.store(ticket + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Ticket of the oldest record that was not drained yet.
+     */
+    uint64_t next() const { return m_next.load(std::memory_order_relaxed); }
+
+    /**
+     * Approximate number of staged but not yet drained records.
+     */
+    std::size_t pending(uint64_t last_ticket) const
+    {
+        return last_ticket - m_next.load(std::memory_order_relaxed);
+    }
+
+    bool full(uint64_t last_ticket) const
+    {
+        return pending(last_ticket) >= _capacity / 2;
+    }
+
+    /**
+     * Number of bytes drained since the ring was created.
+     */
+    uint64_t drained_bytes() const { return m_drained_bytes; }
+
+    /**
+     * Write every record staged so far, in ticket order, to `fd`, passing
+     * `flags` to `write_all`. Only one thread may drain at a time.
+     */
+    bool drain(int fd, int flags = 0)
+    {
+        return drain([&](iovec* iov, int count)
+                     { return write_all(fd, iov, count, flags); });
+    }
+
+    /**
+     * Drain into `write(iov, count)` instead of a file.
+     */
+    template <typename Write> bool drain(Write&& write)
+    {
+        constexpr int batch = 64;
+        iovec iov[batch];
+        auto next = m_next.load(std::memory_order_relaxed);
+        while (true)
+        {
+            int count = 0;
+            for (; count < batch; ++count)
+            {
+                auto& e = entry(next + count);
+                if (e.seq.load(std::memory_order_acquire) != next + count + 1)
+                    break;
+                iov[count] = iovec{e.data.get(), e.length};
+                m_drained_bytes += e.length;
+            }
+            if (count == 0)
+                return true;
+            if (!write(iov, count))
+                return false;
+
+            for (auto i = 0; i < count; ++i, ++next)
+                entry(next).seq.store(next + _capacity,
+                                      std::memory_order_release);
+            m_next.store(next, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    Entry m_entries[_capacity];
+    // Ticket of the oldest record that was not drained yet.
+    std::atomic<uint64_t> m_next;
+    uint64_t m_drained_bytes = 0;
+
+    Entry& entry(uint64_t ticket) { return m_entries[ticket % _capacity]; }
+};
+
+/**
+ * Log writer for a file opened with `O_DIRECT`.
+ *
+ * Records are copied into a block aligned staging buffer and written out in
+ * whole blocks with `pwrite`, the last one padded with zeros. That partial
+ * block stays staged and is written again, completed, by the next flush.
+ * The loader stops at the zero padding, as no record has type 0.
+ */
+class direct_log
+{
+    static constexpr std::size_t _block = 4_KB;
+    static constexpr std::size_t _buffer = 256_KB;
+
+public:
+    /**
+     * Continue the log in `fd` after its first `end` bytes. `flags` are
+     * passed to `pwritev2`.
+     */
+    direct_log(int fd, uint64_t end, int flags)
+        : m_fd(fd), m_flags(flags), m_buffer(nullptr, &std::free)
+    {
+        void* buffer = nullptr;
+        if (posix_memalign(&buffer, _block, _buffer) != 0)
+            throw std::bad_alloc();
+        m_buffer.reset(static_cast<char*>(buffer));
+
+        m_offset = end - end % _block;
+        m_used = m_flushed = end % _block;
+        if (m_used && ::pread(m_fd, buffer, _block, m_offset) < ssize_t(m_used))
+            throw std::runtime_error("Failed to read the end of the log.");
+    }
+
+    /**
+     * Stage `iov`, writing out the buffer whenever it fills up.
+     */
+    bool write(const iovec* iov, int count)
+    {
+        for (auto i = 0; i < count; ++i)
+        {
+            auto* data = static_cast<const char*>(iov[i].iov_base);
+            auto length = iov[i].iov_len;
+            while (length > 0)
+            {
+                auto n = std::min(length, _buffer - m_used);
+                std::memcpy(m_buffer.get() + m_used, data, n);
+                m_used += n;
+                data += n;
+                length -= n;
+                if (m_used == _buffer && !flush())
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Write out everything staged, padded to whole blocks.
+     */
+    bool flush()
+    {
+        if (m_used == m_flushed)
+            return true;
+
+        auto* buffer = m_buffer.get();
+        auto length = pad_to_multiple_of<_block>(m_used);
+        std::memset(buffer + m_used, 0, length - m_used);
+        for (std::size_t done = 0; done < length;)
+        {
+            auto iov = iovec{buffer + done, length - done};
+            auto written = ::pwritev2(m_fd, &iov, 1, m_offset + done, m_flags);
+            if (written < 0 && errno != EINTR)
+                return false;
+            if (written > 0)
+                done += written;
+        }
+
+        auto tail = m_used % _block;
+        std::memmove(buffer, buffer + m_used - tail, tail);
+        m_offset += m_used - tail;
+        m_used = m_flushed = tail;
+        return true;
+    }
+
+private:
+    int m_fd;
+    int m_flags;
+    std::unique_ptr<char, decltype(&std::free)> m_buffer;
+    // File offset of the buffer, how much of it is staged and how much of
+    // that was written out already.
+    uint64_t m_offset = 0;
+    std::size_t m_used = 0;
+    std::size_t m_flushed = 0;
+};
+
+/**
+ * Log striped over several files, each with its own lock and write buffer.
+ *
+ * Every thread appends to one stripe, so writers on different stripes never
+ * contend, and the stripes are synced in parallel. Each record is prefixed
+ * with its ticket; `replay` merges the stripes back into ticket order.
+ */
+class striped_log
+{
+    static constexpr std::size_t _buffer = 64_KB;
+
+    struct alignas(64) Stripe
+    {
+        std::mutex mtx;
+        int fd = -1;
+        std::vector<char> buffer;
+    };
+
+public:
+    explicit striped_log(const std::vector<std::filesystem::path>& files)
+        : m_count(files.size()), m_stripes(new Stripe[files.size()])
+    {
+        for (auto i = 0u; i < m_count; ++i)
+        {
+            auto& stripe = m_stripes[i];
+            stripe.fd = ::open(files[i].c_str(),
+                               O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (stripe.fd < 0)
+                throw std::runtime_error("Failed to open " + files[i].string() +
+                                         " for writing.");
+            stripe.buffer.reserve(_buffer);
+        }
+    }
+    ~striped_log()
+    {
+        for (auto i = 0u; i < m_count; ++i)
+            if (m_stripes[i].fd >= 0)
+                ::close(m_stripes[i].fd);
+    }
+    striped_log(const striped_log&) = delete;
+    striped_log& operator=(const striped_log&) = delete;
+
+    /**
+     * Append the record `parts` with `ticket` to the calling thread's stripe.
+     */
+    bool write(uint64_t ticket, std::initializer_list<std::string_view> parts)
+    {
+        auto& stripe = m_stripes[thread_index() % m_count];
+        std::lock_guard<std::mutex> lock(stripe.mtx);
+
+        auto* data = reinterpret_cast<const char*>(&ticket);
+        stripe.buffer.insert(stripe.buffer.end(), data, data + sizeof(ticket));
+        for (auto part : parts)
+            stripe.buffer.insert(stripe.buffer.end(), part.begin(), part.end());
+
+        return stripe.buffer.size() < _buffer || flush(stripe);
+    }
+
+    /**
+     * Write out and fsync every stripe, all of them in parallel. With
+     * `data_only`, fdatasync instead.
+     */
+    bool sync(bool data_only = false)
+    {
+        auto ok = std::vector<char>(m_count);
+        auto run = [&](std::size_t i)
+        {
+            auto& stripe = m_stripes[i];
+            {
+                std::lock_guard<std::mutex> lock(stripe.mtx);
+                if (!flush(stripe))
+                    return;
+            }
+            auto synced = data_only ? fdatasync(stripe.fd) : fsync(stripe.fd);
+            ok[i] = synced == 0;
+        };
+        {
+            std::vector<std::jthread> threads;
+            for (auto i = 1u; i < m_count; ++i)
+                threads.emplace_back(run, i);
+            run(0);
+        }
+        return std::ranges::all_of(ok, [](char c) { return c; });
+    }
+
+    /**
+     * Call `apply(record)` for the records of all `files` in ticket order, as
+     * long as the tickets are consecutive, and cut every file after the last
+     * applied record. A missing ticket means its stripe lost the record in a
+     * crash, and nothing after it may be replayed. `read(in, record)` parses
+     * one record. Returns the last applied ticket, or 0.
      */
-    vector(const std::filesystem::path& directory) : m_last_id(0)
+    template <typename Record, typename Read, typename Apply>
+    static uint64_t replay(const std::vector<std::filesystem::path>& files,
+                           Read read, Apply apply)
+    {
+        struct Head
+        {
+            std::ifstream in;
+            std::streamoff offset = -1;
+            uint64_t ticket = 0;
+            Record record;
+            bool valid = false;
+        };
+        auto next = [&](Head& h)
+        {
+            h.offset = h.in.tellg();
+            h.in.read(reinterpret_cast<char*>(&h.ticket), sizeof(h.ticket));
+            h.valid = h.in && read(h.in, h.record);
+        };
+
+        auto heads = std::vector<Head>(files.size());
+        for (auto i = 0u; i < files.size(); ++i)
+        {
+            heads[i].in.open(files[i], std::ios::binary);
+            if (heads[i].in)
+                next(heads[i]);
+        }
+
+        uint64_t last = 0;
+        while (true)
+        {
+            Head* min = nullptr;
+            for (auto& h : heads)
+                if (h.valid && (!min || h.ticket < min->ticket))
+                    min = &h;
+            if (!min || (last != 0 && min->ticket != last + 1))
+                break;
+
+            apply(min->record);
+            last = min->ticket;
+            next(*min);
+        }
+
+        for (auto i = 0u; i < files.size(); ++i)
+        {
+            heads[i].in.close();
+            if (heads[i].offset >= 0)
+                std::filesystem::resize_file(files[i], heads[i].offset);
+        }
+        return last;
+    }
+
+private:
+    std::size_t m_count;
+    std::unique_ptr<Stripe[]> m_stripes;
+
+    static std::size_t thread_index()
+    {
+        static std::atomic<std::size_t> next = 0;
+        thread_local std::size_t index = next++;
+        return index;
+    }
+
+    static bool flush(Stripe& stripe)
+    {
+        auto iov = iovec{stripe.buffer.data(), stripe.buffer.size()};
+        if (!write_all(stripe.fd, &iov, 1))
+            return false;
+        stripe.buffer.clear();
+        return true;
+    }
+};
+
+/**
+ * Persistent vector implementation.
+ */
+/**
+ * Process-wide pool of I/O threads that flushes every registered log.
+ *
+ * A log registers a flush function and how often it wants to run. Workers
+ * run it whenever it is due or was woken up, but never twice at once, so
+ * a few threads serve any number of logs.
+ */
+class io_scheduler
+{
+    using clock = std::chrono::steady_clock;
+
+public:
+    struct client
+    {
+        std::function<bool()> flush;
+        std::function<std::chrono::microseconds()> interval;
+        // All guarded by the scheduler's mutex, except `queued`.
+        std::atomic<bool> queued = false;
+        bool running = false;
+        bool again = false;
+        bool removed = false;
+        std::multimap<clock::time_point, std::shared_ptr<client>>::iterator
+            timer;
+        bool timed = false;
+    };
+
+    /**
+     * The scheduler of the process; it starts with one worker.
+     */
+    static io_scheduler& shared()
+    {
+        static io_scheduler scheduler;
+        return scheduler;
+    }
+
+    ~io_scheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_workers = 0;
+        }
+        m_cv.notify_all();
+        m_threads.clear();
+    }
+
+    /**
+     * Use `count` worker threads from now on.
+     */
+    void set_workers(std::size_t count)
+    {
+        count = std::max<std::size_t>(count, 1);
+        std::lock_guard<std::mutex> threads(m_threads_mtx);
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_workers = count;
+        }
+        m_cv.notify_all();
+        // Workers past `count` retire; join them.
+        while (m_threads.size() > count)
+            m_threads.pop_back();
+        start_workers();
+    }
+
+    std::size_t workers() const
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        return m_workers;
+    }
+
+    /**
+     * Call `flush` every `interval()` from now on, or never while that is
+     * zero. A failed flush is fatal.
+     */
+    std::shared_ptr<client>
+    add(std::function<bool()> flush,
+        std::function<std::chrono::microseconds()> interval)
+    {
+        auto c = std::make_shared<client>();
+        c->flush = std::move(flush);
+        c->interval = std::move(interval);
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            schedule(c, clock::now());
+        }
+        m_cv.notify_one();
+
+        std::lock_guard<std::mutex> lock(m_threads_mtx);
+        start_workers();
+        return c;
+    }
+
+    /**
+     * Run the flush of `c` as soon as a worker is free.
+     */
+    void wake(const std::shared_ptr<client>& c)
+    {
+        if (c->queued.exchange(true))
+            return;
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_ready.push_back(c);
+        }
+        m_cv.notify_one();
+    }
+
+    /**
+     * Stop flushing `c`, waiting for a flush that is running.
+     */
+    void remove(const std::shared_ptr<client>& c)
+    {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        c->removed = true;
+        if (c->timed)
+            m_timers.erase(c->timer);
+        c->timed = false;
+        m_done.wait(lock, [&] { return !c->running; });
+    }
+
+private:
+    io_scheduler() = default;
+
+    void schedule(const std::shared_ptr<client>& c, clock::time_point now)
+    {
+        auto interval = c->interval();
+        if (c->removed || interval.count() <= 0)
+            return;
+        c->timer = m_timers.emplace(now + interval, c);
+        c->timed = true;
+    }
+
+    // Callers hold `m_threads_mtx`.
+    void start_workers()
+    {
+        auto count = workers();
+        while (m_threads.size() < count)
+            m_threads.emplace_back([this, index = m_threads.size()]
+                                   { run(index); });
+    }
+
+    void run(std::size_t index)
+    {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        while (index < m_workers)
+        {
+            auto now = clock::now();
+            while (!m_timers.empty() && m_timers.begin()->first <= now)
+            {
+                auto c = m_timers.begin()->second;
+                m_timers.erase(m_timers.begin());
+                c->timed = false;
+                if (!c->queued.exchange(true))
+                    m_ready.push_back(std::move(c));
+            }
+
+            if (m_ready.empty())
+            {
+                if (m_timers.empty())
+                    m_cv.wait(lock);
+                else
+                    m_cv.wait_until(lock, m_timers.begin()->first);
+                continue;
+            }
+
+            auto c = std::move(m_ready.front());
+            m_ready.pop_front();
+            c->queued = false;
+            if (c->removed)
+                continue;
+            if (c->running)
+            {
+                c->again = true;
+                continue;
+            }
+
+            if (c->timed)
+                m_timers.erase(c->timer);
+            c->timed = false;
+            c->running = true;
+            lock.unlock();
+            if (!c->flush())
+                exit(1);
+            lock.lock();
+            c->running = false;
+            schedule(c, clock::now());
+            if (std::exchange(c->again, false) && !c->queued.exchange(true))
+                m_ready.push_back(c);
+            m_done.notify_all();
+        }
+        // Retired; let the others pick up the work.
+        m_cv.notify_all();
+    }
+
+    mutable std::mutex m_mtx;
+    std::condition_variable m_cv;
+    std::condition_variable m_done;
+    std::size_t m_workers = 1;
+    std::deque<std::shared_ptr<client>> m_ready;
+    std::multimap<clock::time_point, std::shared_ptr<client>> m_timers;
+
+    std::mutex m_threads_mtx;
+    std::vector<std::jthread> m_threads;
+};
+
+/**
+ * A vector mirrored to POSIX shared memory: this header, `capacity` index
+ * entries and an arena of payloads in two halves of `arena` bytes.
+ *
+ * Its only writer, `shared_mirror`, publishes an append by storing `size`
+ * after writing the payload and entry past the end. Anything else rewrites
+ * entries while `seq` is odd; readers that see `seq` change retry. When
+ * the current half fills up, the live payloads are compacted into the other
+ * one and `generation` advances.
+ */
+struct shared_layout
+{
+    struct entry
+    {
+        std::atomic<uint64_t> offset;
+        std::atomic<uint64_t> length;
+    };
+
+    // "pvector1", stored last once the rest is initialized.
+    static constexpr uint64_t _magic = 0x31726f7463657670;
+    std::atomic<uint64_t> magic;
+    uint64_t capacity;
+    uint64_t arena;
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> size;
+    std::atomic<uint64_t> generation;
+    std::atomic<bool> overflowed;
+
+    static std::size_t bytes(uint64_t capacity, uint64_t arena)
+    {
+        return sizeof(shared_layout) + capacity * sizeof(entry) + 2 * arena;
+    }
+
+    entry* entries() { return reinterpret_cast<entry*>(this + 1); }
+    char* payloads() { return reinterpret_cast<char*>(entries() + capacity); }
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "shared memory needs address-free atomics");
+
+/**
+ * Writer of a `shared_layout`, owned by a vector. It has a fixed size: once
+ * the vector outgrows it, it stops and readers are told so.
+ */
+class shared_mirror
+{
+public:
+    /**
+     * Create the shared memory object `name`, replacing a stale one, for up
+     * to `capacity` elements and `bytes` of arena.
+     */
+    shared_mirror(const std::string& name, std::size_t capacity,
+                  std::size_t bytes)
+        : m_name(name), m_arena(bytes / 2),
+          m_length(shared_layout::bytes(capacity, m_arena))
+    {
+        ::shm_unlink(name.c_str());
+        int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                            0644);
+        if (fd < 0)
+            throw std::runtime_error("Failed to create " + name);
+        void* memory = MAP_FAILED;
+        if (::ftruncate(fd, m_length) == 0)
+            memory = ::mmap(nullptr, m_length, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (memory == MAP_FAILED)
+        {
+            ::shm_unlink(name.c_str());
+            throw std::runtime_error("Failed to map " + name);
+        }
+
+        m_layout = new (memory) shared_layout;
+        m_layout->capacity = capacity;
+        m_layout->arena = m_arena;
+        std::uninitialized_value_construct_n(m_layout->entries(), capacity);
+        m_layout->magic.store(shared_layout::_magic, std::memory_order_release);
+    }
+
+    ~shared_mirror()
+    {
+        ::munmap(m_layout, m_length);
+        ::shm_unlink(m_name.c_str());
+    }
+
+    shared_mirror(const shared_mirror&) = delete;
+    shared_mirror& operator=(const shared_mirror&) = delete;
+
+    std::size_t size() const
+    {
+        return m_layout->size.load(std::memory_order_relaxed);
+    }
+
+    bool overflowed() const { return m_overflowed; }
+
+    void push_back(std::string_view s)
+    {
+        auto n = size();
+        if (!fits(n + 1, m_live + s.size()))
+            return;
+        if (m_used + s.size() > m_arena)
+        {
+            begin();
+            compact(n);
+            end();
+        }
+        store(n, s);
+        m_layout->size.store(n + 1, std::memory_order_release);
+    }
+
+    /**
+     * Replace the entries in `[first, last)` with `s`, or with nothing.
+     */
+    void replace(std::size_t first, std::size_t last, const std::string* s)
+    {
+        if (m_overflowed)
+            return;
+        auto* entries = m_layout->entries();
+        auto n = size();
+        std::size_t added = s ? 1 : 0;
+        uint64_t removed = 0;
+        for (auto i = first; i < last; ++i)
+            removed += entries[i].length.load(std::memory_order_relaxed);
+        auto size = n - (last - first) + added;
+        if (!fits(size, m_live - removed + (s ? s->size() : 0)))
+            return;
+
+        begin();
+        auto move = [&](std::size_t from, std::size_t to)
+        {
+            auto& source = entries[from];
+            auto& target = entries[to];
+            target.offset.store(source.offset.load(std::memory_order_relaxed),
+                                std::memory_order_relaxed);
+            target.length.store(source.length.load(std::memory_order_relaxed),
+                                std::memory_order_relaxed);
+        };
+        auto to = first + added;
+        if (to < last)
+            for (auto i = last; i < n; ++i)
+                move(i, i - last + to);
+        else if (to > last)
+            for (auto i = n; i-- > last;)
+                move(i, i - last + to);
+        m_live -= removed;
+        if (s)
+        {
+            // Compacting must not keep what the entry held before.
+            entries[first].length.store(0, std::memory_order_relaxed);
+            if (m_used + s->size() > m_arena)
+                compact(size);
+            store(first, *s);
+        }
+        m_layout->size.store(size, std::memory_order_relaxed);
+        end();
+    }
+
+private:
+    std::string m_name;
+    std::size_t m_arena;
+    std::size_t m_length;
+    shared_layout* m_layout;
+    // Which half of the arena payloads go to, how much of it is used, and
+    // how much of that the entries still refer to.
+    std::size_t m_half = 0;
+    std::size_t m_used = 0;
+    std::size_t m_live = 0;
+    bool m_overflowed = false;
+
+    bool fits(std::size_t size, std::size_t live)
+    {
+        if (!m_overflowed && (size > m_layout->capacity || live > m_arena))
+        {
+            m_overflowed = true;
+            m_layout->overflowed.store(true, std::memory_order_release);
+        }
+        return !m_overflowed;
+    }
+
+    void begin()
+    {
+        auto seq = m_layout->seq.load(std::memory_order_relaxed);
+        m_layout->seq.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+    }
+
+    void end()
+    {
+        auto seq = m_layout->seq.load(std::memory_order_relaxed);
+        m_layout->seq.store(seq + 1, std::memory_order_release);
+    }
+
+    /**
+     * Write `s` to the arena and point entry `index` at it.
+     */
+    void store(std::size_t index, std::string_view s)
+    {
+        auto offset = m_half * m_arena + m_used;
+        std::memcpy(m_layout->payloads() + offset, s.data(), s.size());
+        auto& entry = m_layout->entries()[index];
+        entry.offset.store(offset, std::memory_order_relaxed);
+        entry.length.store(s.size(), std::memory_order_relaxed);
+        m_used += s.size();
+        m_live += s.size();
+    }
+
+    /**
+     * Move the payloads of the first `count` entries to the other half.
+     * Callers hold the seqlock.
+     */
+    void compact(std::size_t count)
+    {
+        auto* payloads = m_layout->payloads();
+        auto* entries = m_layout->entries();
+        m_half = 1 - m_half;
+        m_used = 0;
+        for (auto i = 0u; i < count; ++i)
+        {
+            auto offset = entries[i].offset.load(std::memory_order_relaxed);
+            auto length = entries[i].length.load(std::memory_order_relaxed);
+            auto to = m_half * m_arena + m_used;
+            std::memcpy(payloads + to, payloads + offset, length);
+            entries[i].offset.store(to, std::memory_order_relaxed);
+            m_used += length;
+        }
+        m_layout->generation.fetch_add(1, std::memory_order_relaxed);
+    }
+};
+
+/**
+ * Read-only access to a vector that another process shares with
+ * `vector::share`, without system calls or copies.
+ *
+ * A view returned by `at` points into the shared arena. It stays valid until
+ * `generation()` has advanced by two, as the compaction after next reuses
+ * the half it points into. `size` and `at` throw once the vector outgrew the
+ * shared memory.
+ */
+class shared_view
+{
+public:
+    explicit shared_view(const std::string& name)
+    {
+        int fd = ::shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+        if (fd < 0)
+            throw std::runtime_error("Failed to open " + name);
+        struct stat st;
+        void* memory = MAP_FAILED;
+        if (::fstat(fd, &st) == 0 &&
+            std::size_t(st.st_size) >= sizeof(shared_layout))
+        {
+            m_length = st.st_size;
+            memory = ::mmap(nullptr, m_length, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (memory == MAP_FAILED)
+            throw std::runtime_error("Failed to map " + name);
+
+        m_layout = static_cast<shared_layout*>(memory);
+        if (m_layout->magic.load(std::memory_order_acquire) !=
+                shared_layout::_magic ||
+            shared_layout::bytes(m_layout->capacity, m_layout->arena) >
+                m_length)
+        {
+            ::munmap(memory, m_length);
+            throw std::runtime_error(name + " is not a shared vector");
+        }
+    }
+
+    ~shared_view() { ::munmap(m_layout, m_length); }
+
+    shared_view(const shared_view&) = delete;
+    shared_view& operator=(const shared_view&) = delete;
+
+    std::size_t size() const
+    {
+        auto size = m_layout->size.load(std::memory_order_acquire);
+        check();
+        return size;
+    }
+
+    std::string_view at(std::size_t index) const
+    {
+        auto* entries = m_layout->entries();
+        while (true)
+        {
+            auto seq = m_layout->seq.load(std::memory_order_acquire);
+            if (seq & 1)
+            {
+                std::this_thread::yield();
+                continue;
+            }
+            auto size = m_layout->size.load(std::memory_order_acquire);
+            uint64_t offset = 0;
+            uint64_t length = 0;
+            if (index < size)
+            {
+                offset = entries[index].offset.load(std::memory_order_relaxed);
+                length = entries[index].length.load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (m_layout->seq.load(std::memory_order_relaxed) != seq)
+                continue;
+
+            check();
+            if (index >= size)
+                throw std::out_of_range("shared_view::at");
+            return std::string_view(m_layout->payloads() + offset, length);
+        }
+    }
+
+    uint64_t generation() const
+    {
+        return m_layout->generation.load(std::memory_order_acquire);
+    }
+
+private:
+    shared_layout* m_layout;
+    std::size_t m_length = 0;
+
+    void check() const
+    {
+        if (m_layout->overflowed.load(std::memory_order_acquire))
+            throw std::runtime_error("shared_view: the vector outgrew it");
+    }
+};
+
+class store;
+
+class vector
+{
+    friend class store;
+
+    struct alignas(8) Item
+    {
+        uint64_t id;
+        std::string str;
+        // std::stringstream oss;
+
+        // Number of tables holding the item.
+        mutable std::atomic<uint32_t> refs = 1;
+
+        template <typename T>
+        Item(uint64_t id, T&& str) : id{id}, str{std::forward<T>(str)}
+        {
+        }
+
+        static void release(const Item* item)
+        {
+            if (item->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                delete item;
+        }
+    };
+
+    /**
+     * Element slots, split into segments that double in size so that appends
+     * never move a slot. Readers find the table through `m_table` while
+     * pinned; appends and `set` change it in place, everything else publishes
+     * a new table. Snapshots share the table, and a shared table is only
+     * ever appended to.
+     */
+    struct Table
+    {
+        using Slot = std::atomic<const Item*>;
+        static constexpr unsigned first_bits = 6;
+        static constexpr unsigned max_segments = 64 - first_bits;
+
+        // The vector while the table is current, plus one per snapshot.
+        std::atomic<uint32_t> refs = 1;
+        std::atomic<std::size_t> size = 0;
+        // A queue pops elements by moving `head` past them; elements are at
+        // `head` to `size`.
+        std::atomic<std::size_t> head = 0;
+        std::atomic<Slot*> segments[max_segments] = {};
+
+        Table() = default;
+        Table(const Table&) = delete;
+        Table& operator=(const Table&) = delete;
+        ~Table()
+        {
+            for (auto& segment : segments)
+                delete[] segment.load(std::memory_order_relaxed);
+        }
+
+        static std::pair<unsigned, std::size_t> locate(std::size_t index)
+        {
+            auto j = index + (std::size_t(1) << first_bits);
+            unsigned k = std::bit_width(j) - 1;
+            assert(k >= first_bits && k - first_bits < max_segments);
+            return {k - first_bits, j - (std::size_t(1) << k)};
+        }
+
+        Slot& slot(std::size_t index) const
+        {
+            auto [segment, offset] = locate(index);
+            return segments[segment].load(std::memory_order_acquire)[offset];
+        }
+
+        const Item* get(std::size_t index) const
+        {
+            return slot(index).load(std::memory_order_acquire);
+        }
+
+        /**
+         * Like `slot()`, but allocates the segment if it does not exist yet.
+         * Safe to call from concurrent appenders.
+         */
+        Slot& reserve(std::size_t index)
+        {
+            auto [segment, offset] = locate(index);
+            auto* slots = segments[segment].load(std::memory_order_acquire);
+            if (!slots)
+            {
+                auto* fresh =
+                    new Slot[std::size_t(1) << (first_bits + segment)]();
+                if (segments[segment].compare_exchange_strong(slots, fresh))
+                    slots = fresh;
+                else
+                    delete[] fresh;
+            }
+            return slots[offset];
+        }
+
+        /**
+         * The item at `index`, or null if nobody stored one there yet.
+         */
+        const Item* peek(std::size_t index) const
+        {
+            auto [segment, offset] = locate(index);
+            auto* slots = segments[segment].load(std::memory_order_acquire);
+            return slots ? slots[offset].load() : nullptr;
+        }
+
+        /**
+         * Drop one reference; the last one releases every item and frees
+         * the table.
+         */
+        static void release(Table* table)
+        {
+            if (table->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+                return;
+            auto size = table->size.load(std::memory_order_relaxed);
+            auto head = table->head.load(std::memory_order_relaxed);
+            for (auto i = head; i < size; ++i)
+                Item::release(table->get(i));
+            delete table;
+        }
+    };
+
+    struct Header
+    {
+        uint64_t type;
+        uint64_t id;
+        union
+        {
+            uint64_t dsize;
+            uint64_t rindex;
+        };
+    };
+
+    /**
+     * One decoded log record.
+     */
+    struct Record
+    {
+        Header header;
+        // ERASE_RANGE: number of items, INSERT and SET: index, NAME and
+        // VECTOR: number of the vector in a store.
+        uint64_t arg = 0;
+        std::string data;
+    };
+
+    /**
+     * Start of a checkpoint file: the last id logged before it, where the
+     * log continues, and how many PUSHBACK records with the elements follow.
+     */
+    struct Checkpoint
+    {
+        uint64_t id;
+        uint64_t segment;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+public:
+    /**
+     * Read-only random access iterator over the elements.
+     */
+    class const_iterator
+    {
+    public:
+        using iterator_concept = std::random_access_iterator_tag;
+        // `reference` is a prvalue, so this is only an input iterator to
+        // pre-C++20 algorithms.
+        using iterator_category = std::input_iterator_tag;
+        using value_type = std::string_view;
+        using difference_type = std::ptrdiff_t;
+        using reference = std::string_view;
+
+        const_iterator() = default;
+
+        reference operator*() const { return m_table->get(m_index)->str; }
+        reference operator[](difference_type n) const
+        {
+            return m_table->get(m_index + n)->str;
+        }
+
+        const_iterator& operator++()
+        {
+            ++m_index;
+            return *this;
+        }
+        const_iterator operator++(int)
+        {
+            return const_iterator(m_table, m_index++);
+        }
+        const_iterator& operator--()
+        {
+            --m_index;
+            return *this;
+        }
+        const_iterator operator--(int)
+        {
+            return const_iterator(m_table, m_index--);
+        }
+        const_iterator& operator+=(difference_type n)
+        {
+            m_index += n;
+            return *this;
+        }
+        const_iterator& operator-=(difference_type n)
+        {
+            m_index -= n;
+            return *this;
+        }
+
+        friend const_iterator operator+(const_iterator it, difference_type n)
+        {
+            return it += n;
+        }
+        friend const_iterator operator+(difference_type n, const_iterator it)
+        {
+            return it += n;
+        }
+        friend const_iterator operator-(const_iterator it, difference_type n)
+        {
+            return it -= n;
+        }
+        friend difference_type operator-(const_iterator a, const_iterator b)
+        {
+            return difference_type(a.m_index - b.m_index);
+        }
+        friend bool operator==(const_iterator a, const_iterator b)
+        {
+            return a.m_index == b.m_index;
+        }
+        friend auto operator<=>(const_iterator a, const_iterator b)
+        {
+            return a.m_index <=> b.m_index;
+        }
+
+    private:
+        friend class vector;
+        const_iterator(const Table* table, std::size_t index)
+            : m_table(table), m_index(index)
+        {
+        }
+
+        const Table* m_table = nullptr;
+        std::size_t m_index = 0;
+    };
+
+    /**
+     * While a reader holds one, views returned by `at()` and iterators stay
+     * valid even if another thread modifies the vector.
+     */
+    using read_guard = epoch_domain::guard;
+
+    /**
+     * Read-only view of the vector as it was when `snapshot()` was taken.
+     * Later modifications of the vector do not show up in it. The view
+     * shares storage with the vector instead of copying it, may outlive the
+     * vector and is safe to read from any thread.
+     */
+    class snapshot_view
+    {
+    public:
+        snapshot_view() = default;
+        snapshot_view(const snapshot_view& other)
+            : m_table(other.m_table), m_head(other.m_head),
+              m_size(other.m_size)
+        {
+            if (m_table)
+                m_table->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+        snapshot_view(snapshot_view&& other) noexcept
+            : m_table(std::exchange(other.m_table, nullptr)),
+              m_head(std::exchange(other.m_head, 0)),
+              m_size(std::exchange(other.m_size, 0))
+        {
+        }
+        snapshot_view& operator=(snapshot_view other) noexcept
+        {
+            std::swap(m_table, other.m_table);
+            std::swap(m_head, other.m_head);
+            std::swap(m_size, other.m_size);
+            return *this;
+        }
+        ~snapshot_view()
+        {
+            if (m_table)
+                Table::release(m_table);
+        }
+
+        std::size_t size() const { return m_size; }
+
+        std::string_view at(std::size_t index) const
+        {
+            if (index >= m_size)
+                throw std::out_of_range("vector::snapshot_view::at");
+            return std::string_view(m_table->get(m_head + index)->str);
+        }
+
+        const_iterator begin() const
+        {
+            return const_iterator(m_table, m_head);
+        }
+        const_iterator end() const
+        {
+            return const_iterator(m_table, m_head + m_size);
+        }
+
+    private:
+        friend class vector;
+        snapshot_view(Table* table, std::size_t head, std::size_t size)
+            : m_table(table), m_head(head), m_size(size)
+        {
+        }
+
+        Table* m_table = nullptr;
+        std::size_t m_head = 0;
+        std::size_t m_size = 0;
+    };
+
+    /**
+     * When the flusher writes out and fsyncs the log: every `interval`, and
+     * early once `bytes` or `records` are pending. A zero disables that
+     * trigger.
+     *
+     * With a `target_latency`, `records` is only the starting point: after
+     * every flush the batch shrinks if the oldest record took longer than
+     * the target to become durable and grows otherwise.
+     */
+    struct flush_policy
+    {
+        std::chrono::microseconds interval = std::chrono::seconds(1);
+        std::size_t bytes = 1024_KB;
+        std::size_t records = 256;
+        std::chrono::microseconds target_latency{0};
+    };
+
+    /**
+     * When a modification is durable, from weakest to strongest:
+     * - `memory`: never; the vector has no log at all.
+     * - `os_buffered`: once the call returns it is written to the log, but
+     *   not fsynced.
+     * - `periodic`: once the flusher ran, see `flush_policy`.
+     * - `group_commit`: once the call returns; concurrent calls share one
+     *   fsync.
+     * - `sync_per_op`: once the call returns; every call fsyncs.
+     * - `replicated`: like `group_commit`, and the follower set up with
+     *   `replicate_to` has persisted it too.
+     */
+    enum class durability
+    {
+        memory,
+        os_buffered,
+        periodic,
+        group_commit,
+        sync_per_op,
+        replicated,
+    };
+
+    /**
+     * How a sync makes the log durable:
+     * - `fsync`: flush data and all metadata.
+     * - `fdatasync`: skip metadata that is not needed to read the data back,
+     *   such as timestamps.
+     * - `dsync`: write with `RWF_DSYNC`, so every write is durable when it
+     *   returns and a sync has nothing left to do. Striped logs fdatasync
+     *   instead.
+     */
+    enum class sync_method
+    {
+        fsync,
+        fdatasync,
+        dsync,
+    };
+
+    struct options
+    {
+        durability level = durability::periodic;
+        flush_policy flush;
+        sync_method sync = sync_method::fsync;
+        // Start write-back whenever this many bytes were written since the
+        // last time, so a sync finds little dirty data. 0 leaves it to sync.
+        std::size_t writeback = 0;
+        // Reserve disk space ahead of the log this many bytes at a time, so
+        // appends rarely allocate blocks. 0 never reserves.
+        std::size_t preallocate = 0;
+        // Bypass the page cache with `O_DIRECT`, see `direct_log`. Falls back
+        // to buffered writes of the same blocks where the filesystem does
+        // not support it.
+        bool direct = false;
+        // Stripe the log over this many files, `.vector.bin.<n>`, so that
+        // concurrent writers do not share one file. 0 keeps a single file.
+        std::size_t stripes = 0;
+        // Optional directory for every stripe, e.g. one per device. The
+        // stripes go to the vector's directory otherwise.
+        std::vector<std::filesystem::path> stripe_directories;
+        // Follow a log that another process writes instead of writing it,
+        // see `refresh`. Every `flush.interval` it looks for new records.
+        bool read_only = false;
+        // Have the flusher write a checkpoint whenever the log grew by this
+        // many bytes since the last one, see `checkpoint`. 0 only writes
+        // them on request.
+        std::size_t checkpoint_bytes = 0;
+        // How many of the latest tokens `push_back(token, v)` remembers.
+        std::size_t dedup_window = 64_KB;
+        // Use the vector as a FIFO queue, see `pop_front`: it only pushes
+        // and pops, and its log moves on to a new segment once one holds
+        // `segment_bytes`, so that consumed segments can be deleted.
+        bool queue = false;
+        std::size_t segment_bytes = 64 * 1024_KB;
+    };
+
+    /**
+     * Modifications that reach the log as one record, written and synced
+     * at once, so that after a crash either all or none of them come back.
+     * Nothing happens before `commit`; every index refers to the vector as
+     * the operations before it leave it. Readers may see the operations of
+     * a committed transaction take effect one at a time.
+     */
+    class transaction
+    {
+    public:
+        void push_back(std::string_view v)
+        {
+            assert(v.size() <= 4_KB);
+            add(Header{.type = PUSHBACK, .id = 0, .dsize = v.size()}, 0, v);
+        }
+
+        void insert(std::size_t index, std::string_view v)
+        {
+            assert(v.size() <= 4_KB);
+            add(Header{.type = INSERT, .id = 0, .dsize = v.size()}, index, v);
+        }
+
+        void set(std::size_t index, std::string_view v)
+        {
+            assert(v.size() <= 4_KB);
+            add(Header{.type = SET, .id = 0, .dsize = v.size()}, index, v);
+        }
+
+        void erase(std::size_t index)
+        {
+            add(Header{.type = ERASE, .id = 0, .rindex = index}, 0, {});
+        }
+
+        void erase(std::size_t first, std::size_t last)
+        {
+            if (first > last)
+                throw std::out_of_range("vector::transaction::erase");
+            add(Header{.type = ERASE_RANGE, .id = 0, .rindex = first},
+                last - first, {});
+        }
+
+        void clear()
+        {
+            add(Header{.type = CLEAR, .id = 0, .rindex = 0}, 0, {});
+        }
+
+        /**
+         * Apply and log every operation, durable as `d` says like a
+         * `push_back`. If an index is out of range, throws
+         * `std::out_of_range` before doing either.
+         */
+        void commit(std::optional<durability> d = {})
+        {
+            if (!m_vector)
+                throw std::logic_error("vector::transaction: committed");
+            m_vector->apply_transaction(m_records, d);
+            m_vector = nullptr;
+            m_records.clear();
+        }
+
+    private:
+        friend class vector;
+        explicit transaction(vector& v) : m_vector(&v) {}
+
+        vector* m_vector;
+        std::vector<Record> m_records;
+
+        void add(const Header& header, uint64_t arg, std::string_view data)
+        {
+            if (!m_vector)
+                throw std::logic_error("vector::transaction: committed");
+            auto& r = m_records.emplace_back();
+            r.header = header;
+            r.arg = arg;
+            r.data = data;
+        }
+    };
+
+    /**
+     * Create a new vector that can be persistent to `directory`.
+     */
+    vector(const std::filesystem::path& directory)
+        : vector(directory, options{})
+    {
+    }
+
+    /**
+     * Create a new vector that can be persistent to `directory`. A striped
+     * vector has to be reopened with the same stripes.
+     */
+    vector(const std::filesystem::path& directory, const options& opts)
+        : vector(directory, opts, {})
+    {
+    }
+
+private:
+    /**
+     * Open the log of a store, passing its NAME and VECTOR records to
+     * `route`.
+     */
+    vector(const std::filesystem::path& directory, const options& opts,
+           std::function<void(Record&)> route)
+        : m_table(new Table), m_last_id(0), m_ring(1), m_durability(opts.level),
+          m_sync(opts.sync), m_writeback(opts.writeback),
+          m_preallocate(opts.preallocate),
+          m_checkpoint_bytes(opts.checkpoint_bytes),
+          m_dedup_window(opts.dedup_window), m_queue(opts.queue),
+          m_segment_bytes(opts.segment_bytes), m_route(std::move(route))
+    {
+        set_flush_policy(opts.flush);
+        if (m_queue && (opts.stripes || !opts.stripe_directories.empty() ||
+                        opts.direct))
+        {
+            throw std::invalid_argument(
+                "vector: a queue keeps a single buffered log");
+        }
+        if (opts.read_only)
+        {
+            if (opts.stripes || opts.direct ||
+                std::filesystem::exists(directory / stripe_name(0)))
+            {
+                throw std::invalid_argument(
+                    "vector: only a single log file can be followed");
+            }
+            tail(directory);
+            return;
+        }
+        if (m_durability == durability::memory)
+            return;
+
+        std::filesystem::path filepath;
+        filepath = directory / _filename;
+        auto stripes = stripe_files(directory, opts);
+        if (!stripes.empty() && m_durability != durability::periodic)
+        {
+            throw std::invalid_argument(
+                "vector: a striped log is only flushed periodically");
+        }
+        if (!stripes.empty() && opts.direct)
+            throw std::invalid_argument("vector: a striped log is buffered");
+
+        if (stripes.empty() &&
+            std::filesystem::exists(directory / stripe_name(0)))
+        {
+            throw std::runtime_error(filepath.string() +
+                                     " is striped; reopen it with its stripes");
+        }
+
+        m_directory = directory;
+        load(filepath, stripes);
+        filepath = directory / segment_name(m_segment);
+
+        if (!stripes.empty())
+        {
+            m_stripes = std::make_unique<striped_log>(stripes);
+        }
+        else
+        {
+            // `direct_log` writes at explicit offsets, which O_APPEND would
+            // ignore.
+            auto flags = O_CREAT | O_CLOEXEC;
+            flags |= opts.direct ? O_RDWR : O_WRONLY | O_APPEND;
+            m_fd = -1;
+            if (opts.direct)
+                m_fd = ::open(filepath.c_str(), flags | O_DIRECT, 0644);
+            if (m_fd < 0)
+                m_fd = ::open(filepath.c_str(), flags, 0644);
+
+            if (m_fd < 0)
+            {
+                throw std::runtime_error("Failed to open " + filepath.string() +
+                                         " for reading.");
+            }
+            m_file_end = m_written_back = m_allocated = m_synced_end =
+                ::lseek(m_fd, 0, SEEK_END);
+            if (opts.direct)
+            {
+                auto dsync = m_sync == sync_method::dsync ? RWF_DSYNC : 0;
+                m_direct =
+                    std::make_unique<direct_log>(m_fd, m_file_end, dsync);
+            }
+        }
+
+        if (m_durability != durability::periodic)
+            return;
+        m_flusher = io_scheduler::shared().add(
+            [this]
+            {
+                if (m_head_moved.exchange(false))
+                    exclusive([this] { log_head(); });
+                bool due = false;
+                {
+                    std::lock_guard<std::mutex> lock(m_mtx);
+                    if (!flush())
+                        return false;
+                    due = m_checkpoint_bytes &&
+                          m_ring.drained_bytes() - m_checkpointed >=
+                              m_checkpoint_bytes;
+                }
+                if (due)
+                    checkpoint();
+                return true;
+            },
+            [this]
+            {
+                return std::chrono::microseconds(
+                    m_flush_interval.load(std::memory_order_relaxed));
+            });
+    }
+    /**
+     * Rebuild the vector in `directory` as of id `until`, see `open_at`.
+     */
+    vector(uint64_t until, const std::filesystem::path& directory)
+        : m_table(new Table), m_last_id(0), m_ring(1),
+          m_durability(durability::memory)
+    {
+        set_flush_policy({});
+        if (std::filesystem::exists(directory / stripe_name(0)))
+        {
+            throw std::invalid_argument(
+                "vector: a striped log has no single history");
+        }
+        m_directory = directory;
+        load(directory / _filename, {}, until);
+    }
+
+    /**
+     * Replay the log in `directory` without ever writing to it, then keep
+     * refreshing from where the replay stopped.
+     */
+    void tail(const std::filesystem::path& directory)
+    {
+        m_read_only = true;
+        m_durability = durability::memory;
+        m_directory = directory;
+        load(directory / _filename, {});
+        m_flusher = io_scheduler::shared().add(
+            [this]
+            {
+                refresh();
+                return true;
+            },
+            [this]
+            {
+                return std::chrono::microseconds(
+                    m_flush_interval.load(std::memory_order_relaxed));
+            });
+    }
+
+    /**
+     * The vector numbered `number` in the store whose log is `log`, rebuilt
+     * from its `records`.
+     */
+    vector(vector& log, uint64_t number, std::vector<Record> records)
+        : m_table(new Table), m_last_id(0), m_ring(1),
+          m_durability(log.m_durability),
+          m_dedup_window(log.m_dedup_window), m_log(&log), m_number(number)
+    {
+        std::vector<std::unique_ptr<Item>> items;
+        uint64_t last_id = 0;
+        for (auto& record : records)
+        {
+            auto in = std::istringstream(std::move(record.data));
+            Record r;
+            if (!read_record(in, r))
+                break;
+            if (r.header.type != ERASE && r.header.type != ERASE_RANGE)
+                last_id = std::max(last_id, r.header.id);
+            if (r.header.type == PUSHBACK_TOKEN)
+                remember(r.arg, r.header.id);
+            apply_record(items, r);
+        }
+        adopt(items, last_id);
+    }
+
+public:
+    ~vector()
+    {
+        if (m_flusher)
+            io_scheduler::shared().remove(m_flusher);
+
+        // The flusher may never have run.
+        if (m_head_moved.exchange(false))
+            exclusive([this] { log_head(); });
+        sync();
+        if (m_fd >= 0)
+            ::close(m_fd);
+
+        Table::release(m_table.load());
+    }
+
+    vector(const vector& v) = delete;
+    vector& operator=(const vector& v) = delete;
+
+    vector(vector&& v) noexcept : m_table(new Table), m_ring(1)
+    {
+        *this = std::move(v);
+    }
+    vector& operator=(vector&& v) noexcept
+    {
+        if (this != &v)
+        {
+            m_table = v.m_table.exchange(m_table.load());
+        }
+        return *this;
+    }
+
+    void push_back(const std::string& v, std::optional<durability> d = {})
+    {
+        push_back(std::string_view(v), d);
+    }
+
+    /**
+     * Append `v`, moving it into storage instead of copying it.
+     *
+     * Every `push_back` overload may be called from many threads at once.
+     * The element becomes visible to readers once every append that started
+     * before it has finished too. `d` makes this call more durable than the
+     * vector's own level; it cannot make it less.
+     */
+    void push_back(std::string&& v, std::optional<durability> d = {})
+    {
+        auto level = effective(d);
+        std::string_view payload = v;
+        commit(append(payload, std::move(v)), level);
+    }
+
+    void push_back(std::string_view v, std::optional<durability> d = {})
+    {
+        auto level = effective(d);
+        commit(append(v, v), level);
+    }
+
+    void push_back(const char* v, std::optional<durability> d = {})
+    {
+        push_back(std::string_view(v), d);
+    }
+
+    /**
+     * Append `v` unless a call with the same `token` did already, and
+     * return whether this one appended. The token is logged with the
+     * element, and the latest `options::dedup_window` tokens are remembered
+     * across restarts, so retrying a call that timed out is safe. A retry
+     * returns once the original element is as durable as `d` asks.
+     */
+    bool push_back(uint64_t token, std::string_view v,
+                   std::optional<durability> d = {})
+    {
+        if (m_read_only)
+            throw std::logic_error("vector: read-only");
+        auto level = effective(d);
+        bool taken = false;
+        {
+            std::lock_guard<std::mutex> lock(m_tokens_mtx);
+            taken = m_tokens.contains(token);
+            if (!taken)
+                remember(token, 0);
+        }
+        uint64_t original = 0;
+        if (taken && duplicate(token, original))
+        {
+            commit(original, level);
+            return false;
+        }
+
+        auto id = append(v, v, {}, token);
+        {
+            std::lock_guard<std::mutex> lock(m_tokens_mtx);
+            if (auto it = m_tokens.find(token); it != m_tokens.end())
+                it->second = id;
+        }
+        commit(id, level);
+        return true;
+    }
+
+    /**
+     * Append `v` only if the vector holds exactly `expected_size` elements,
+     * counting appends still in flight, and return whether it did. The
+     * check is a single compare-and-swap on the next id, so writers that
+     * coordinate optimistically need no lock: whoever loses reads `size()`
+     * again and retries.
+     */
+    bool try_push_back(std::size_t expected_size, std::string_view v,
+                       std::optional<durability> d = {})
+    {
+        auto level = effective(d);
+        auto id = append(v, v, expected_size);
+        if (!id)
+            return false;
+        commit(id, level);
+        return true;
+    }
+
+    /**
+     * Append raw bytes; they are stored and logged like a string.
+     */
+    void push_back(std::span<const std::byte> v,
+                   std::optional<durability> d = {})
+    {
+        auto* data = reinterpret_cast<const char*>(v.data());
+        push_back(std::string_view(data, v.size()), d);
+    }
+
+    /**
+     * Insert `v` before the element at `index`.
+     */
+    void insert(std::size_t index, const std::string& v)
+    {
+        rearranges();
+        uint64_t id = 0;
+        exclusive(
+            [&]
+            {
+                if (index > size())
+                    throw std::out_of_range("vector::insert");
+
+                id = write_indexed(INSERT, index, v);
+                replace(index, index, new Item(id, v));
+            });
+        commit(id, m_durability);
+    }
+
+    /**
+     * Replace the element at `index` with `v`.
+     */
+    void set(std::size_t index, const std::string& v)
+    {
+        rearranges();
+        uint64_t id = 0;
+        exclusive(
+            [&]
+            {
+                auto* table = m_table.load(std::memory_order_relaxed);
+                if (index >= table->size.load(std::memory_order_relaxed))
+                    throw std::out_of_range("vector::set");
+
+                id = write_indexed(SET, index, v);
+                if (table->refs.load() > 1)
+                {
+                    // A snapshot shares the table; leave it alone.
+                    replace(index, index + 1, new Item(id, v));
+                    return;
+                }
+                auto* item = new Item(id, v);
+                auto* old = table->slot(index).exchange(
+                    item, std::memory_order_release);
+                m_epoch.retire([old] { Item::release(old); });
+                if (m_mirror)
+                    m_mirror->replace(index, index + 1, &item->str);
+            });
+        commit(id, m_durability);
+    }
+
+    /**
+     * Safe to call from any thread, concurrently with a writer. Hold a
+     * `read_guard` to keep the returned view valid while others modify the
+     * vector.
+     */
+    std::string_view at(std::size_t index) const
+    {
+        auto guard = pin();
+        auto* table = m_table.load();
+        auto head = table->head.load(std::memory_order_acquire);
+        if (index >= table->size.load(std::memory_order_acquire) - head)
+            throw std::out_of_range("vector::at");
+        return std::string_view(table->get(head + index)->str);
+    }
+
+    /**
+     * Resolve `out[i] = at(indices[i])` for every `i` in one pass.
+     *
+     * The lookups run in ascending index order so neighbouring requests share
+     * cache lines and pages, and both the element and its payload are
+     * prefetched a few lookups ahead.
+     */
+    void at_many(std::span<const std::size_t> indices,
+                 std::span<std::string_view> out) const
+    {
+        if (out.size() < indices.size())
+            throw std::invalid_argument("vector::at_many");
+
+        auto guard = pin();
+        auto* table = m_table.load();
+        auto head = table->head.load(std::memory_order_acquire);
+        auto size = table->size.load(std::memory_order_acquire) - head;
+
+        auto order = std::vector<std::pair<std::size_t, std::size_t>>();
+        order.reserve(indices.size());
+        for (auto i = 0u; i < indices.size(); ++i)
+        {
+            if (indices[i] >= size)
+                throw std::out_of_range("vector::at_many");
+            order.emplace_back(head + indices[i], i);
+        }
+        std::sort(order.begin(), order.end());
+
+        constexpr std::size_t distance = 8;
+        auto count = order.size();
+        for (auto k = 0u; k < count; ++k)
+        {
+            if (k + 2 * distance < count)
+                __builtin_prefetch(table->get(order[k + 2 * distance].first));
+            if (k + distance < count)
+                __builtin_prefetch(
+                    table->get(order[k + distance].first)->str.data());
+
+            auto [index, position] = order[k];
+            out[position] = table->get(index)->str;
+        }
+    }
+
+    void erase(std::size_t index, std::optional<durability> d = {})
+    {
+        rearranges();
+        auto level = effective(d);
+        uint64_t ticket = 0;
+        exclusive(
+            [&]
+            {
+                auto* table = m_table.load(std::memory_order_relaxed);
+                if (index >= table->size.load(std::memory_order_relaxed))
+                    throw std::out_of_range("vector::erase");
+
+                // std::cout << "[erase]" << std::endl;
+                auto id = table->get(index)->id;
+                auto header = Header{.type = ERASE, .id = id, .rindex = index};
+                ticket = next_id();
+                stage(ticket, {bytes(header)});
+
+                replace(index, index + 1, nullptr);
+            });
+        commit(ticket, level);
+    }
+
+    /**
+     * Erase the elements in `[first, last)` with a single log record.
+     */
+    void erase(std::size_t first, std::size_t last,
+               std::optional<durability> d = {})
+    {
+        rearranges();
+        auto level = effective(d);
+        uint64_t ticket = 0;
+        exclusive(
+            [&]
+            {
+                auto* table = m_table.load(std::memory_order_relaxed);
+                auto size = table->size.load(std::memory_order_relaxed);
+                if (first > last || last > size)
+                    throw std::out_of_range("vector::erase");
+                if (first == last)
+                    return;
+
+                auto id = table->get(first)->id;
+                auto header =
+                    Header{.type = ERASE_RANGE, .id = id, .rindex = first};
+                uint64_t count = last - first;
+                ticket = next_id();
+                stage(ticket, {bytes(header), bytes(count)});
+
+                replace(first, last, nullptr);
+            });
+        if (ticket)
+            commit(ticket, level);
+    }
+
+    /**
+     * Erase every element with a single log record.
+     */
+    void clear()
+    {
+        rearranges();
+        uint64_t id = 0;
+        exclusive(
+            [&]
+            {
+                id = next_id();
+                auto header = Header{.type = CLEAR, .id = id, .rindex = 0};
+                stage(id, {bytes(header)});
+
+                replace(0, size(), nullptr);
+            });
+        commit(id, m_durability);
+    }
+
+    /**
+     * Remove and return the first element of a queue, or nothing if it is
+     * empty. Takes O(1) amortized: the head moves past the element, and the
+     * table is only rebuilt once most of it was popped.
+     *
+     * Pops are not logged one by one. A periodically durable queue logs how
+     * far it got when it flushes, so after a crash the elements popped since
+     * come back once more; `d` logs and commits right away.
+     */
+    std::optional<std::string> pop_front(std::optional<durability> d = {})
+    {
+        if (!m_queue)
+            throw std::logic_error("vector: not a queue");
+        auto level = effective(d);
+        std::optional<std::string> front;
+        uint64_t ticket = 0;
+        exclusive(
+            [&]
+            {
+                auto* table = m_table.load(std::memory_order_relaxed);
+                auto head = table->head.load(std::memory_order_relaxed);
+                auto n = table->size.load(std::memory_order_relaxed);
+                if (head == n)
+                    return;
+
+                auto* item = table->get(head);
+                front = item->str;
+                if (table->refs.load() > 1)
+                {
+                    // A snapshot shares the table; leave it alone.
+                    replace(head, head + 1, nullptr);
+                }
+                else
+                {
+                    table->head.store(++head, std::memory_order_release);
+                    if (m_mirror)
+                        m_mirror->replace(0, 1, nullptr);
+                    m_epoch.retire([item] { Item::release(item); });
+                    if (head >= _min_compact && head * 2 >= n)
+                        replace(head, head, nullptr);
+                    m_epoch.collect();
+                }
+
+                if (level == durability::periodic)
+                    m_head_moved.store(true, std::memory_order_relaxed);
+                else
+                    ticket = log_head();
+            });
+        if (ticket)
+            commit(ticket, level);
+        return front;
+    }
+
+    /**
+     * Safe to call from any thread, concurrently with a writer.
+     */
+    std::size_t size() const
+    {
+        auto guard = pin();
+        auto* table = m_table.load();
+        auto head = table->head.load(std::memory_order_acquire);
+        return table->size.load(std::memory_order_acquire) - head;
+    }
+
+    /**
+     * Pin the current storage; see `read_guard`.
+     */
+    read_guard pin() const { return m_epoch.pin(); }
+
+    /**
+     * Stream the vector to a follower reading `fd`, a Unix socket or pipe,
+     * with `follow`: first the current contents, then every record as it is
+     * written to the log. With a socket the follower acknowledges what it
+     * persisted, which `durability::replicated` waits for. Replication
+     * stops when the follower goes away; `fd` stays owned by the caller.
+     */
+    void replicate_to(int fd)
+    {
+        if (m_stripes || m_log || m_durability == durability::memory)
+            throw std::invalid_argument("vector: cannot replicate this log");
+
+        exclusive(
+            [&]
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                if (!drain() && !recover())
+                    exit(1);
+
+                // Records before the next ticket are all in the table.
+                std::string frames;
+                auto frame = [&](std::initializer_list<std::string_view> parts)
+                {
+                    uint64_t ticket = 0;
+                    frames += bytes(ticket);
+                    for (auto part : parts)
+                        frames += part;
+                };
+                frame({bytes(Header{.type = CLEAR, .id = 0, .rindex = 0})});
+                auto* table = m_table.load(std::memory_order_relaxed);
+                for (auto i = table->head.load(); i < table->size; ++i)
+                {
+                    auto* item = table->get(i);
+                    auto header = Header{.type = PUSHBACK,
+                                         .id = item->id,
+                                         .dsize = item->str.size()};
+                    frame({bytes(header), item->str});
+                }
+
+                auto iov = iovec{frames.data(), frames.size()};
+                std::lock_guard<std::mutex> replica(m_replica_mtx);
+                struct stat st;
+                m_replica_acks = ::fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+                m_replica_acked = 0;
+                m_ack_length = 0;
+                m_replica_fd = send_all(fd, &iov, 1) ? fd : -1;
+            });
+    }
+
+    /**
+     * Apply what a primary streams over `fd` with `replicate_to`, logging
+     * it like any other modification, until the primary goes away. Sends an
+     * acknowledgement whenever everything received so far is persisted.
+     */
+    void follow(int fd)
+    {
+        uint64_t applied = 0;
+        uint64_t acked = 0;
+        auto idle = [&]
+        {
+            if (applied == acked)
+                return;
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                if (!sync())
+                    exit(1);
+            }
+            acked = applied;
+            // Fails on a pipe; then nobody waits for it anyway.
+            ::send(fd, &acked, sizeof(acked), MSG_NOSIGNAL);
+        };
+        fd_streambuf buffer(fd, idle);
+        std::istream in(&buffer);
+
+        uint64_t ticket;
+        Record r;
+        while (in.read(reinterpret_cast<char*>(&ticket), sizeof(ticket)) &&
+               read_record(in, r))
+        {
+            // The primary sends records again after it failed to log them.
+            if (ticket && ticket <= applied)
+                continue;
+            exclusive([&] { apply_live(r, true); });
+            applied = std::max(applied, ticket);
+        }
+        idle();
+    }
+
+    /**
+     * Start a transaction on this vector; see `transaction`.
+     */
+    transaction begin_transaction() { return transaction(*this); }
+
+    /**
+     * The vector in `directory` as it was when the record with id `id` was
+     * logged, up to the first record with a later id. Replay starts from
+     * the latest checkpoint at or before `id`. The result lives in memory
+     * only and leaves the log alone.
+     */
+    static vector open_at(const std::filesystem::path& directory, uint64_t id)
+    {
+        return vector(id, directory);
+    }
+
+    /**
+     * Write the current contents, with where the log continues after them,
+     * to `.vector.bin.at<id>` and return `id`, the last id logged. Old
+     * checkpoints are kept: together they index the log by id for
+     * `open_at`. Writers are only held up while the log is synced.
+     */
+    uint64_t checkpoint()
+    {
+        if (m_stripes || m_log || m_durability == durability::memory)
+            throw std::invalid_argument("vector: cannot checkpoint this log");
+
+        std::lock_guard<std::mutex> checkpointing(m_checkpoint_mtx);
+        Checkpoint position;
+        snapshot_view contents;
+        exclusive(
+            [&]
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                if (!sync())
+                    exit(1);
+                m_checkpointed = m_ring.drained_bytes();
+
+                auto* table = m_table.load(std::memory_order_relaxed);
+                auto head = table->head.load(std::memory_order_relaxed);
+                auto size =
+                    table->size.load(std::memory_order_relaxed) - head;
+                table->refs.fetch_add(1, std::memory_order_relaxed);
+                contents = snapshot_view(table, head, size);
+                position = {.id = m_last_id.load(std::memory_order_relaxed),
+                            .segment = m_segment,
+                            .offset = m_file_end,
+                            .size = size};
+            });
+
+        auto path = m_directory / checkpoint_name(position.id);
+        auto temporary = path;
+        temporary += ".tmp";
+        int fd = ::open(temporary.c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            throw std::runtime_error("Failed to open " + temporary.string());
+
+        std::string buffer(bytes(position));
+        bool ok = true;
+        auto write = [&]
+        {
+            iovec iov{buffer.data(), buffer.size()};
+            ok = ok && write_all(fd, &iov, 1);
+            buffer.clear();
+        };
+        for (auto i = 0u; i < position.size; ++i)
+        {
+            auto* item = contents.m_table->get(contents.m_head + i);
+            auto header = Header{
+                .type = PUSHBACK, .id = item->id, .dsize = item->str.size()};
+            buffer += bytes(header);
+            buffer += item->str;
+            if (buffer.size() >= 1024_KB)
+                write();
+        }
+        write();
+        ok = ok && fsync(fd) == 0;
+        ::close(fd);
+        if (!ok || ::rename(temporary.c_str(), path.c_str()) != 0 ||
+            !sync_directory())
+        {
+            std::filesystem::remove(temporary);
+            throw std::runtime_error("Failed to write " + path.string());
+        }
+        return position.id;
+    }
+
+    /**
+     * Mirror the vector to the POSIX shared memory object `name`, such as
+     * "/jobs", for other processes to read through a `shared_view`, until
+     * the vector is destroyed. The mirror holds up to `capacity` elements
+     * whose payloads take up to `bytes / 2`; beyond that it stops.
+     */
+    void share(const std::string& name, std::size_t capacity,
+               std::size_t bytes)
+    {
+        exclusive(
+            [&]
+            {
+                auto mirror =
+                    std::make_unique<shared_mirror>(name, capacity, bytes);
+                auto* table = m_table.load(std::memory_order_relaxed);
+                auto n = table->size.load(std::memory_order_relaxed);
+                for (auto i = table->head.load(); i < n; ++i)
+                    mirror->push_back(table->get(i)->str);
+                m_mirror = std::move(mirror);
+            });
+    }
+
+    /**
+     * Apply the records another process appended to the log since the last
+     * call, following it into new segments, and return how many there were.
+     * Only for a `read_only` vector, where it also runs periodically. A
+     * torn record at the end is picked up once it is complete.
+     */
+    std::size_t refresh()
+    {
+        if (!m_read_only)
+            throw std::logic_error("vector: only a read-only vector follows");
+
+        std::size_t count = 0;
+        auto apply = [&](Record& r)
+        {
+            apply_live(r, false);
+            ++count;
+            return true;
+        };
+        exclusive(
+            [&]
+            {
+                while (true)
+                {
+                    auto path = m_directory / segment_name(m_segment);
+                    auto next = m_directory / segment_name(m_segment + 1);
+                    auto cutoff = read_marker(next);
+                    auto limit =
+                        cutoff.value_or(std::numeric_limits<uint64_t>::max());
+                    if (std::filesystem::exists(path))
+                    {
+                        m_tail_offset =
+                            load_from_file(path, apply, limit, m_tail_offset);
+                    }
+                    if (!cutoff)
+                        break;
+                    // The new segment repeats everything past the cutoff,
+                    // including what we already applied.
+                    m_tail_offset =
+                        sizeof(Header) + std::max(m_tail_offset, *cutoff) -
+                        *cutoff;
+                    ++m_segment;
+                }
+            });
+        return count;
+    }
+
+    /**
+     * Change when the log is flushed. Safe to call while other threads
+     * modify the vector.
+     */
+    void set_flush_policy(const flush_policy& policy)
+    {
+        m_flush_interval.store(policy.interval.count(),
+                               std::memory_order_relaxed);
+        m_flush_bytes.store(policy.bytes, std::memory_order_relaxed);
+        m_flush_records.store(policy.records, std::memory_order_relaxed);
+        m_flush_target.store(policy.target_latency.count(),
+                             std::memory_order_relaxed);
+        if (m_flusher)
+            io_scheduler::shared().wake(m_flusher);
+    }
+
+    flush_policy get_flush_policy() const
+    {
+        return flush_policy{
+            .interval = std::chrono::microseconds(
+                m_flush_interval.load(std::memory_order_relaxed)),
+            .bytes = m_flush_bytes.load(std::memory_order_relaxed),
+            .records = m_flush_records.load(std::memory_order_relaxed),
+            .target_latency = std::chrono::microseconds(
+                m_flush_target.load(std::memory_order_relaxed))};
+    }
+
+    /**
+     * Take a consistent read-only view of the vector in O(1). Appends keep
+     * running meanwhile; the first modification other than an append after
+     * a snapshot copies the element pointers once, never the elements.
+     */
+    snapshot_view snapshot() const
+    {
+        std::lock_guard<std::mutex> lock(m_gate.sections());
+        auto* table = m_table.load(std::memory_order_relaxed);
+        table->refs.fetch_add(1, std::memory_order_relaxed);
+        auto head = table->head.load(std::memory_order_relaxed);
+        return snapshot_view(
+            table, head, table->size.load(std::memory_order_acquire) - head);
+    }
+
+    const_iterator begin() const
+    {
+        auto* table = m_table.load();
+        return const_iterator(table,
+                              table->head.load(std::memory_order_acquire));
+    }
+    const_iterator end() const
+    {
+        auto* table = m_table.load();
+        return const_iterator(table,
+                              table->size.load(std::memory_order_acquire));
+    }
+
+    /**
+     * Call `fn` with every element, splitting the index space into one
+     * contiguous chunk per thread. `fn` may run concurrently with itself and
+     * must not modify the vector. The first exception thrown is rethrown
+     * after every thread finished.
+     */
+    template <typename Fn>
+        requires std::invocable<Fn&, std::string_view>
+    void parallel_for_each(
+        Fn fn, unsigned threads = std::thread::hardware_concurrency()) const
+    {
+        auto guard = pin();
+        auto* table = m_table.load();
+        auto head = table->head.load(std::memory_order_acquire);
+        auto n = table->size.load(std::memory_order_acquire) - head;
+        auto chunks = std::max<std::size_t>(
+            1, std::min<std::size_t>(threads, n / _min_chunk));
+        auto chunk = (n + chunks - 1) / chunks;
+        auto errors = std::vector<std::exception_ptr>(chunks);
+
+        auto run = [&](std::size_t c)
+        {
+            try
+            {
+                auto first = const_iterator(table, head + c * chunk);
+                auto last = const_iterator(
+                    table, head + std::min(n, (c + 1) * chunk));
+                for (; first != last; ++first)
+                    fn(*first);
+            }
+            catch (...)
+            {
+                errors[c] = std::current_exception();
+            }
+        };
+
+        {
+            std::vector<std::jthread> pool;
+            pool.reserve(chunks - 1);
+            for (auto c = 1u; c < chunks; ++c)
+                pool.emplace_back(run, c);
+            run(0);
+        }
+
+        for (auto& e : errors)
+            if (e)
+                std::rethrow_exception(e);
+    }
+
+private:
+    static constexpr uint64_t PUSHBACK = 1;
+    static constexpr uint64_t ERASE = 2;
+    static constexpr uint64_t ERASE_RANGE = 3;
+    static constexpr uint64_t CLEAR = 4;
+    static constexpr uint64_t INSERT = 5;
+    static constexpr uint64_t SET = 6;
+    static constexpr uint64_t SEGMENT = 7;
+    static constexpr uint64_t NAME = 8;
+    static constexpr uint64_t VECTOR = 9;
+    static constexpr uint64_t TRANSACTION = 10;
+    static constexpr uint64_t COMMIT = 11;
+    static constexpr uint64_t PUSHBACK_TOKEN = 12;
+    static constexpr uint64_t HEAD = 13;
+    static constexpr std::size_t _max_transaction = 64 * 1024_KB;
+    inline static constexpr const char* _filename = ".vector.bin";
+    // Below this many elements per thread, spawning threads costs more than
+    // the scan itself.
+    static constexpr std::size_t _min_chunk = 16_KB;
+    // A queue rebuilds its table once this many popped slots make up at
+    // least half of it.
+    static constexpr std::size_t _min_compact = 4_KB;
+    std::atomic<Table*> m_table;
+    mutable epoch_domain m_epoch;
+    int m_fd = -1;
+
+    // The log continues in a new segment whenever writing or syncing the
+    // current one fails. Everything written to it since the last sync is
+    // kept so it can be written again; guarded by `m_mtx`.
+    std::filesystem::path m_directory;
+    std::size_t m_segment = 0;
+    // A read-only vector does not write the log but follows it; it has
+    // applied everything in the current segment before this offset.
+    bool m_read_only = false;
+    uint64_t m_tail_offset = 0;
+    uint64_t m_synced_end = 0;
+    std::vector<char> m_unsynced;
+    static constexpr int _max_retries = 3;
+
+    // Appends run concurrently inside `m_gate`; every other modification
+    // runs alone. Each log record takes the next id, and an append's index
+    // follows from its id because nothing but appends can run between two
+    // exclusive sections.
+    mutable append_gate m_gate;
+    std::atomic<uint64_t> m_last_id;
+    uint64_t m_base_id = 1;
+    std::size_t m_base_index = 0;
+    record_ring m_ring;
+    std::unique_ptr<striped_log> m_stripes;
+
+    // Registration with the I/O scheduler; `m_mtx` makes sure only one
+    // thread drains `m_ring` at a time.
+    std::shared_ptr<io_scheduler::client> m_flusher;
+    std::mutex m_mtx;
+
+    // The flush policy, and what was staged since the last flush.
+    std::atomic<std::chrono::microseconds::rep> m_flush_interval;
+    std::atomic<std::size_t> m_flush_bytes;
+    std::atomic<std::size_t> m_flush_records;
+    durability m_durability = durability::periodic;
+    // How the log reaches the disk, and how far it got; guarded by `m_mtx`.
+    sync_method m_sync = sync_method::fsync;
+    std::size_t m_writeback = 0;
+    std::size_t m_preallocate = 0;
+    uint64_t m_file_end = 0;
+    uint64_t m_written_back = 0;
+    uint64_t m_allocated = 0;
+    std::unique_ptr<direct_log> m_direct;
+
+    // Write a checkpoint every `m_checkpoint_bytes` of log; `m_checkpointed`
+    // is how much of it was drained at the last one, guarded by `m_mtx`.
+    std::size_t m_checkpoint_bytes = 0;
+    uint64_t m_checkpointed = 0;
+    std::mutex m_checkpoint_mtx;
+
+    // Tokens of the latest `push_back(token, v)` calls with the ids they
+    // got, 0 while in flight; the oldest go beyond `m_dedup_window`.
+    std::size_t m_dedup_window = 64_KB;
+    std::mutex m_tokens_mtx;
+    std::unordered_map<uint64_t, uint64_t> m_tokens;
+    std::deque<uint64_t> m_token_order;
+
+    // A queue logs how far it was popped as a HEAD record, at once or, if
+    // only periodically durable, when the flusher sees `m_head_moved`.
+    // `m_head_logged` is the id of the front element in the last one, or
+    // its own id if the queue was empty. Guarded by `m_mtx`, `m_heads` has
+    // the HEAD records that are not synced yet by ticket, `m_durable_head`
+    // the front of the last one that is, and `m_segment_ends` the last
+    // ticket in each earlier segment still on disk.
+    bool m_queue = false;
+    std::size_t m_segment_bytes = 0;
+    std::atomic<bool> m_head_moved = false;
+    uint64_t m_head_logged = 0;
+    std::deque<std::pair<uint64_t, uint64_t>> m_heads;
+    uint64_t m_durable_head = 0;
+    std::deque<std::pair<std::size_t, uint64_t>> m_segment_ends;
+
+    // The log of a store passes the records of its vectors to `m_route`.
+    // A vector of a store logs through `m_log` instead, under `m_number`,
+    // and `m_ticketed` is the last id it took a ticket for.
+    std::function<void(Record&)> m_route;
+    vector* m_log = nullptr;
+    uint64_t m_number = 0;
+    std::atomic<uint64_t> m_ticketed = 0;
+
+    // Mirror of `share`. Appends update it under `m_mirror_mtx`, everything
+    // else in exclusive sections.
+    std::unique_ptr<shared_mirror> m_mirror;
+    std::mutex m_mirror_mtx;
+
+    // Follower of `replicate_to`, whether it can acknowledge and the last
+    // ticket it did. `m_replica_mtx` guards reading acknowledgements.
+    std::atomic<int> m_replica_fd = -1;
+    std::atomic<bool> m_replica_acks = false;
+    std::mutex m_replica_mtx;
+    std::atomic<uint64_t> m_replica_acked = 0;
+    uint64_t m_ack = 0;
+    std::size_t m_ack_length = 0;
+    // Every record before this id is fsynced.
+    std::atomic<uint64_t> m_durable = 1;
+    std::atomic<std::chrono::microseconds::rep> m_flush_target;
+    std::atomic<std::size_t> m_pending_bytes = 0;
+    std::atomic<std::size_t> m_pending_records = 0;
+    // When the oldest pending record was staged.
+    std::atomic<std::chrono::steady_clock::rep> m_pending_since = 0;
+    static constexpr std::size_t _max_batch = 64_KB;
+
+    template <typename T> static std::string_view bytes(const T& v)
+    {
+        return std::string_view(reinterpret_cast<const char*>(&v), sizeof(v));
+    }
+
+    uint64_t next_id() { return m_last_id.fetch_add(1) + 1; }
+
+    void rearranges() const
+    {
+        if (m_queue)
+            throw std::logic_error("vector: a queue only pushes and pops");
+    }
+
+    /**
+     * Log a HEAD record if the front of the queue moved since the last one
+     * and return its ticket, or 0. Callers run it inside `exclusive`.
+     */
+    uint64_t log_head()
+    {
+        if (m_durability == durability::memory)
+            return 0;
+        auto* table = m_table.load(std::memory_order_relaxed);
+        auto head = table->head.load(std::memory_order_relaxed);
+        auto n = table->size.load(std::memory_order_relaxed);
+        // An empty queue drops everything before the record itself.
+        auto front = head < n ? table->get(head)->id : m_last_id + 1;
+        if (front == m_head_logged)
+            return 0;
+
+        auto ticket = next_id();
+        auto header = Header{.type = HEAD, .id = ticket, .rindex = front};
+        stage(ticket, {bytes(header)});
+        m_head_logged = front;
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_heads.emplace_back(ticket, front);
+        return ticket;
+    }
+
+    /**
+     * Remember that the element with id `id` was appended with `token`,
+     * forgetting the oldest token beyond the window. Callers hold
+     * `m_tokens_mtx` unless nobody else can use the vector yet.
+     */
+    void remember(uint64_t token, uint64_t id)
+    {
+        if (!m_tokens.try_emplace(token, id).second)
+            return;
+        m_token_order.push_back(token);
+        if (m_token_order.size() > m_dedup_window)
+        {
+            m_tokens.erase(m_token_order.front());
+            m_token_order.pop_front();
+        }
+    }
+
+    /**
+     * Wait until the call that took `token` has its id, which may still be
+     * appending, and store it in `id`. Returns false if the window forgot
+     * the token meanwhile.
+     */
+    bool duplicate(uint64_t token, uint64_t& id)
+    {
+        while (true)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_tokens_mtx);
+                auto it = m_tokens.find(token);
+                if (it == m_tokens.end())
+                    return false;
+                id = it->second;
+            }
+            if (id)
+                return true;
+            std::this_thread::yield();
+        }
+    }
+
+    /**
+     * The id of the append at `index`, or 0 if another append took it
+     * already. Callers hold the append gate.
+     */
+    uint64_t next_id(std::optional<std::size_t> index)
+    {
+        if (!index)
+            return next_id();
+        // Pops only run in exclusive sections, so the head stays put.
+        auto head = m_table.load(std::memory_order_relaxed)->head.load(
+            std::memory_order_relaxed);
+        if (*index + head < m_base_index)
+            return 0;
+        uint64_t last = m_base_id + (*index + head - m_base_index) - 1;
+        if (!m_last_id.compare_exchange_strong(last, last + 1))
+            return 0;
+        return last + 1;
+    }
+
+    /**
+     * Log `payload` as a PUSHBACK record and publish an item built from `v`.
+     */
+    template <typename T>
+    uint64_t append(std::string_view payload, T&& v,
+                    std::optional<std::size_t> at = {},
+                    std::optional<uint64_t> token = {})
+    {
+        auto length = payload.size();
+        assert(length <= 4_KB);
+
+        append_gate::shared_lock gate(m_gate);
+        auto id = next_id(at);
+        if (!id)
+            return 0;
+        auto index = m_base_index + (id - m_base_id);
+
+        // std::cout << "[push_back]" << std::endl;
+        auto header = Header{.type = PUSHBACK, .id = id, .dsize = length};
+        if (token)
+        {
+            header.type = PUSHBACK_TOKEN;
+            stage(id, {bytes(header), bytes(*token), payload});
+        }
+        else
+        {
+            stage(id, {bytes(header), payload});
+        }
+
+        publish(index, new Item(id, std::forward<T>(v)));
+        return id;
+    }
+
+    /**
+     * Store `item` at `index` and move the published size over every slot
+     * that is filled by now. Whoever fills the slot at the published size
+     * carries it forward, so no appender waits for a slower one.
+     */
+    void publish(std::size_t index, const Item* item)
+    {
+        auto* table = m_table.load(std::memory_order_relaxed);
+        table->reserve(index).store(item);
+
+        auto n = table->size.load();
+        while (table->peek(n))
+        {
+            if (table->size.compare_exchange_weak(n, n + 1))
+                ++n;
+        }
+        if (m_mirror)
+            mirror_published();
+    }
+
+    /**
+     * Mirror every element published since the last call. Appends call it
+     * concurrently, and whichever comes first mirrors them all in order.
+     */
+    void mirror_published()
+    {
+        std::lock_guard<std::mutex> lock(m_mirror_mtx);
+        if (m_mirror->overflowed())
+            return;
+        auto* table = m_table.load(std::memory_order_relaxed);
+        auto n = table->size.load(std::memory_order_acquire);
+        auto head = table->head.load(std::memory_order_relaxed);
+        for (auto i = head + m_mirror->size(); i < n; ++i)
+            m_mirror->push_back(table->get(i)->str);
+    }
+
+    /**
+     * Run `fn` while no append is in flight, then let appends continue with
+     * the next id at the new end of the vector.
+     */
+    template <typename Fn> void exclusive(Fn&& fn)
+    {
+        append_gate::unique_lock gate(m_gate);
+        fn();
+        m_base_id = m_last_id.load(std::memory_order_relaxed) + 1;
+        m_base_index =
+            m_table.load(std::memory_order_relaxed)->size.load(
+                std::memory_order_relaxed);
+    }
+
+    /**
+     * Stage the record with id `id` for the log. Drains the ring when it
+     * fills up; otherwise the flusher drains it.
+     */
+    void stage(uint64_t id, std::initializer_list<std::string_view> parts)
+    {
+        if (m_read_only)
+            throw std::logic_error("vector: read-only");
+        if (m_durability == durability::memory)
+            return;
+        if (m_log)
+        {
+            // Take tickets in id order, so that the shared log keeps the
+            // records of this vector in order.
+            while (m_ticketed.load(std::memory_order_acquire) != id - 1)
+                std::this_thread::yield();
+            thread_local std::string record;
+            record.clear();
+            for (auto part : parts)
+                record += part;
+            m_log->stage_for(VECTOR, m_number, record);
+            m_ticketed.store(id, std::memory_order_release);
+            return;
+        }
+        if (m_stripes)
+        {
+            if (!m_stripes->write(id, parts))
+                exit(1);
+            notify_pending(parts);
+            return;
+        }
+
+        while (!m_ring.try_stage(id, parts))
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                if (!drain() && !recover())
+                    exit(1);
+            }
+            std::this_thread::yield();
+        }
+
+        if (m_ring.full(id))
+        {
+            std::unique_lock<std::mutex> lock(m_mtx, std::try_to_lock);
+            if (lock && !drain() && !recover())
+                exit(1);
+        }
+        notify_pending(parts);
+    }
+
+    /**
+     * Log `data` for the vector numbered `number` of a store, as a record
+     * of `type` with a ticket of its own.
+     */
+    void stage_for(uint64_t type, uint64_t number, std::string_view data)
+    {
+        auto ticket = next_id();
+        auto header = Header{.type = type, .id = ticket, .dsize = data.size()};
+        stage(ticket, {bytes(header), bytes(number), data});
+    }
+
+    /**
+     * Publish a copy of the table with `[first, last)` replaced by `item`
+     * (if any) and retire the old table. Unless a snapshot shares the old
+     * table, the kept items move over and only the dropped ones are
+     * released.
+     */
+    void replace(std::size_t first, std::size_t last, const Item* item)
+    {
+        auto* table = m_table.load(std::memory_order_relaxed);
+        auto n = table->size.load(std::memory_order_relaxed);
+        bool shared = table->refs.load() > 1;
+
+        auto* next = new Table;
+        std::size_t size = 0;
+        auto put = [&](const Item* item)
+        { next->reserve(size++).store(item, std::memory_order_relaxed); };
+        auto keep = [&](const Item* item)
+        {
+            if (shared)
+                item->refs.fetch_add(1, std::memory_order_relaxed);
+            put(item);
+        };
+        auto head = table->head.load(std::memory_order_relaxed);
+        for (auto i = head; i < first; ++i)
+            keep(table->get(i));
+        if (item)
+            put(item);
+        for (auto i = last; i < n; ++i)
+            keep(table->get(i));
+        next->size.store(size, std::memory_order_relaxed);
+
+        m_table.store(next);
+        if (m_mirror)
+            m_mirror->replace(first - head, last - head,
+                              item ? &item->str : nullptr);
+        if (shared)
+        {
+            m_epoch.retire([table] { Table::release(table); });
+        }
+        else
+        {
+            m_epoch.retire(
+                [=]
+                {
+                    for (auto i = first; i < last; ++i)
+                        Item::release(table->get(i));
+                    delete table;
+                });
+        }
+        m_epoch.collect();
+    }
+
+    /**
+     * Log a record that carries both an index and a payload and return its
+     * id.
+     */
+    uint64_t write_indexed(uint64_t type, uint64_t index, const std::string& v)
+    {
+        auto length = v.size();
+        assert(length <= 4_KB);
+
+        auto id = next_id();
+        auto header = Header{.type = type, .id = id, .dsize = length};
+        stage(id, {bytes(header), bytes(index), v});
+        return id;
+    }
+
+    /**
+     * Write out everything staged so far and fsync it. Callers hold `m_mtx`.
+     */
+    bool sync()
+    {
+        m_pending_bytes.store(0, std::memory_order_relaxed);
+        m_pending_records.store(0, std::memory_order_relaxed);
+        if (m_durability == durability::memory || m_log)
+            return true;
+        if (m_stripes)
+            return m_stripes->sync(m_sync != sync_method::fsync);
+
+        auto synced = [&]
+        {
+            if (m_sync == sync_method::fsync)
+                return fsync(m_fd) == 0;
+            if (m_sync == sync_method::fdatasync)
+                return fdatasync(m_fd) == 0;
+            return true;
+        };
+        for (auto attempt = 0; !(drain() && synced()); ++attempt)
+        {
+            if (attempt == _max_retries || !recover())
+                return false;
+        }
+        m_synced_end = m_file_end;
+        m_unsynced.clear();
+        m_durable.store(m_ring.next());
+        if (m_queue)
+            drop_consumed();
+        return true;
+    }
+
+    /**
+     * Delete the segments of a queue whose elements were all popped by the
+     * last synced HEAD record, oldest first, and move on to a new segment
+     * once the current one is full. Callers hold `m_mtx` right after a
+     * sync.
+     */
+    void drop_consumed()
+    {
+        while (!m_heads.empty() && m_heads.front().first < m_durable.load())
+        {
+            m_durable_head = m_heads.front().second;
+            m_heads.pop_front();
+        }
+        while (!m_segment_ends.empty() &&
+               m_segment_ends.front().second < m_durable_head)
+        {
+            auto index = m_segment_ends.front().first;
+            std::error_code ec;
+            std::filesystem::remove(m_directory / segment_name(index), ec);
+            if (ec)
+                break;
+            m_segment_ends.pop_front();
+        }
+        if (m_file_end >= m_segment_bytes)
+        {
+            auto segment = m_segment;
+            if (open_segment())
+                m_segment_ends.emplace_back(segment, m_ring.next() - 1);
+        }
+    }
+
+    /**
+     * After a failed write or sync, nothing past the last sync can be
+     * trusted to be on disk, and syncing again would not tell. So continue
+     * the log in a new segment: it starts with a SEGMENT record that cuts
+     * the current one off where it was last synced, followed by everything
+     * written since. Callers hold `m_mtx`.
+     */
+    bool recover()
+    {
+        if (m_direct || !retains_unsynced())
+            return false;
+        return open_segment();
+    }
+
+    /**
+     * Continue the log in the next segment, starting with a SEGMENT record
+     * that cuts the current one off where it was last synced and followed
+     * by `m_unsynced`. Callers hold `m_mtx`.
+     */
+    bool open_segment()
+    {
+        auto segment = m_segment + 1;
+        auto path = m_directory / segment_name(segment);
+        int fd = ::open(path.c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                        0644);
+        if (fd < 0)
+            return false;
+
+        auto header = Header{.type = SEGMENT, .id = 0, .rindex = m_synced_end};
+        iovec iov[] = {{&header, sizeof(header)},
+                       {m_unsynced.data(), m_unsynced.size()}};
+        if (!write_all(fd, iov, 2) || fsync(fd) != 0 || !sync_directory())
+        {
+            ::close(fd);
+            return false;
+        }
+
+        ::close(m_fd);
+        m_fd = fd;
+        m_segment = segment;
+        m_file_end = sizeof(header) + m_unsynced.size();
+        m_synced_end = m_written_back = m_allocated = m_file_end;
+        m_unsynced.clear();
+        return true;
+    }
+
+    /**
+     * Whether `m_unsynced` is kept. An `os_buffered` vector never syncs, so
+     * it would keep everything and cannot recover.
+     */
+    bool retains_unsynced() const
+    {
+        return m_durability >= durability::periodic;
+    }
+
+    bool sync_directory()
+    {
+        int fd =
+            ::open(m_directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        bool ok = fsync(fd) == 0;
+        ::close(fd);
+        return ok;
+    }
+
+    /**
+     * Write the staged records to the log, reserving space for them first
+     * and starting write-back of what accumulated. Callers hold `m_mtx`.
+     */
+    bool drain()
+    {
+        auto flags = m_sync == sync_method::dsync ? RWF_DSYNC : 0;
+        if (m_preallocate && m_file_end + m_preallocate / 2 > m_allocated)
+        {
+            // Only a hint; filesystems without fallocate just grow the file.
+            auto from = std::max(m_allocated, m_file_end);
+            if (::fallocate(m_fd, FALLOC_FL_KEEP_SIZE, from, m_preallocate) ==
+                0)
+                m_allocated = from + m_preallocate;
+        }
+
+        auto before = m_ring.drained_bytes();
+        if (m_direct)
+        {
+            auto write = [&](iovec* iov, int count)
+            { return replicate(iov, count) && m_direct->write(iov, count); };
+            if (!m_ring.drain(write) || !m_direct->flush())
+                return false;
+            m_file_end += m_ring.drained_bytes() - before;
+            return true;
+        }
+        auto write = [&](iovec* iov, int count)
+        {
+            if (!replicate(iov, count))
+                return false;
+            if (!retains_unsynced())
+                return write_all(m_fd, iov, count, flags);
+
+            auto size = m_unsynced.size();
+            for (auto i = 0; i < count; ++i)
+            {
+                auto* data = static_cast<const char*>(iov[i].iov_base);
+                m_unsynced.insert(m_unsynced.end(), data,
+                                  data + iov[i].iov_len);
+            }
+            if (write_all(m_fd, iov, count, flags))
+                return true;
+            m_unsynced.resize(size);
+            return false;
+        };
+        if (!m_ring.drain(write))
+            return false;
+        m_file_end += m_ring.drained_bytes() - before;
+
+        if (m_writeback && m_file_end - m_written_back >= m_writeback)
+        {
+            // Also a hint; the next sync writes back whatever is left.
+            ::sync_file_range(m_fd, m_written_back,
+                              m_file_end - m_written_back,
+                              SYNC_FILE_RANGE_WRITE);
+            m_written_back = m_file_end;
+        }
+        return true;
+    }
+
+    /**
+     * Send the records in `iov`, the next ones to be drained, to the
+     * follower, each behind its ticket. Never fails; a follower that went
+     * away is dropped. Callers hold `m_mtx`.
+     */
+    bool replicate(const iovec* iov, int count)
+    {
+        if (m_replica_fd < 0)
+            return true;
+
+        std::vector<iovec> frames;
+        std::vector<uint64_t> tickets(count);
+        for (auto i = 0; i < count; ++i)
+        {
+            tickets[i] = m_ring.next() + i;
+            frames.push_back({&tickets[i], sizeof(uint64_t)});
+            frames.push_back(iov[i]);
+        }
+        if (!send_all(m_replica_fd, frames.data(), frames.size()))
+        {
+            m_replica_fd = -1;
+            return true;
+        }
+
+        // Keep the acknowledgements from piling up, unless somebody waits
+        // for one already.
+        std::unique_lock<std::mutex> lock(m_replica_mtx, std::try_to_lock);
+        if (lock && m_replica_acks)
+            receive_acks(false);
+        return true;
+    }
+
+    /**
+     * Read the acknowledgements the follower sent, waiting for one with
+     * `block`. Callers hold `m_replica_mtx`.
+     */
+    bool receive_acks(bool block)
+    {
+        while (m_replica_fd >= 0)
+        {
+            auto* buffer = reinterpret_cast<char*>(&m_ack);
+            auto n = ::recv(m_replica_fd, buffer + m_ack_length,
+                            sizeof(m_ack) - m_ack_length,
+                            block ? 0 : MSG_DONTWAIT);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return true;
+            if (n <= 0)
+            {
+                m_replica_fd = -1;
+                return false;
+            }
+            m_ack_length += n;
+            if (m_ack_length == sizeof(m_ack))
+            {
+                m_replica_acked = std::max(m_replica_acked.load(), m_ack);
+                m_ack_length = 0;
+                if (block)
+                    return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Apply a record written by another vector, a primary or the writer
+     * of a log we tail, while readers may be running. Ids stay those of the
+     * record; with `log`, it is logged under a ticket of our own. Callers
+     * run it inside `exclusive`.
+     */
+    void apply_live(Record& r, bool log)
+    {
+        auto& header = r.header;
+        auto ticket = log ? next_id() : 0;
+        auto record = [&](std::initializer_list<std::string_view> parts)
+        {
+            if (log)
+                stage(ticket, parts);
+        };
+        auto* table = m_table.load(std::memory_order_relaxed);
+        auto size = table->size.load(std::memory_order_relaxed);
+        switch (header.type)
+        {
+        case PUSHBACK:
+            record({bytes(header), r.data});
+            publish(size, new Item(header.id, std::move(r.data)));
+            break;
+        case PUSHBACK_TOKEN:
+        {
+            record({bytes(header), bytes(r.arg), r.data});
+            publish(size, new Item(header.id, std::move(r.data)));
+            std::lock_guard<std::mutex> lock(m_tokens_mtx);
+            remember(r.arg, header.id);
+            break;
+        }
+        case ERASE:
+            record({bytes(header)});
+            replace(header.rindex, header.rindex + 1, nullptr);
+            break;
+        case ERASE_RANGE:
+            record({bytes(header), bytes(r.arg)});
+            replace(header.rindex, header.rindex + r.arg, nullptr);
+            break;
+        case CLEAR:
+            record({bytes(header)});
+            replace(table->head, size, nullptr);
+            break;
+        case HEAD:
+        {
+            record({bytes(header)});
+            auto head = table->head.load(std::memory_order_relaxed);
+            auto last = head;
+            while (last < size && table->get(last)->id < header.rindex)
+                ++last;
+            replace(head, last, nullptr);
+            break;
+        }
+        case INSERT:
+        case SET:
+        {
+            record({bytes(header), bytes(r.arg), r.data});
+            auto* item = new Item(header.id, std::move(r.data));
+            auto last = header.type == SET ? r.arg + 1 : r.arg;
+            replace(r.arg, last, item);
+            break;
+        }
+        case TRANSACTION:
+        {
+            auto commit = Header{.type = COMMIT, .id = header.id,
+                                 .rindex = r.arg};
+            record({bytes(header), bytes(r.arg), r.data, bytes(commit)});
+            for_each_in(r, [&](Record& inner) { apply_live(inner, false); });
+            break;
+        }
+        }
+    }
+
+    /**
+     * Apply `ops` and log them as one TRANSACTION record: its header, the
+     * number of records, the records themselves and a COMMIT header that
+     * repeats the id and the number. Throws before doing either if an index
+     * is out of range.
+     */
+    void apply_transaction(std::vector<Record>& ops,
+                           std::optional<durability> d)
+    {
+        if (m_log)
+            throw std::invalid_argument("vector: a store has no transactions");
+        if (m_read_only)
+            throw std::logic_error("vector: read-only");
+        rearranges();
+
+        auto level = effective(d);
+        uint64_t ticket = 0;
+        exclusive(
+            [&]
+            {
+                auto size = m_table.load(std::memory_order_relaxed)
+                                ->size.load(std::memory_order_relaxed);
+                for (auto& op : ops)
+                {
+                    auto index = op.header.rindex;
+                    bool valid = true;
+                    switch (op.header.type)
+                    {
+                    case PUSHBACK:
+                        ++size;
+                        break;
+                    case INSERT:
+                        valid = op.arg <= size++;
+                        break;
+                    case SET:
+                        valid = op.arg < size;
+                        break;
+                    case ERASE:
+                        valid = index < size--;
+                        break;
+                    case ERASE_RANGE:
+                        valid = index + op.arg <= size;
+                        size -= valid ? op.arg : 0;
+                        break;
+                    case CLEAR:
+                        size = 0;
+                        break;
+                    }
+                    if (!valid)
+                        throw std::out_of_range("vector::transaction");
+                }
+                if (ops.empty())
+                    return;
+
+                ticket = next_id();
+                std::string records;
+                uint64_t count = 0;
+                for (auto& op : ops)
+                {
+                    auto& header = op.header;
+                    auto* table = m_table.load(std::memory_order_relaxed);
+                    auto n = table->size.load(std::memory_order_relaxed);
+                    if (header.type == ERASE_RANGE && op.arg == 0)
+                        continue;
+                    if (header.type == ERASE || header.type == ERASE_RANGE)
+                        header.id = table->get(header.rindex)->id;
+                    else
+                        header.id = ticket;
+
+                    records += bytes(header);
+                    if (header.type == ERASE_RANGE || header.type == INSERT ||
+                        header.type == SET)
+                        records += bytes(op.arg);
+                    records += op.data;
+                    ++count;
+
+                    switch (header.type)
+                    {
+                    case PUSHBACK:
+                        publish(n, new Item(ticket, std::move(op.data)));
+                        break;
+                    case INSERT:
+                        replace(op.arg, op.arg, new Item(ticket, op.data));
+                        break;
+                    case SET:
+                        replace(op.arg, op.arg + 1, new Item(ticket, op.data));
+                        break;
+                    case ERASE:
+                        replace(header.rindex, header.rindex + 1, nullptr);
+                        break;
+                    case ERASE_RANGE:
+                        replace(header.rindex, header.rindex + op.arg, nullptr);
+                        break;
+                    case CLEAR:
+                        replace(0, n, nullptr);
+                        break;
+                    }
+                }
+
+                auto header = Header{
+                    .type = TRANSACTION, .id = ticket, .dsize = records.size()};
+                auto commit =
+                    Header{.type = COMMIT, .id = ticket, .rindex = count};
+                stage(ticket,
+                      {bytes(header), bytes(count), records, bytes(commit)});
+            });
+        if (ticket)
+            commit(ticket, level);
+    }
+
+    /**
+     * Call `fn` with every record of the TRANSACTION record `r`.
+     */
+    template <typename Fn> static void for_each_in(Record& r, Fn fn)
+    {
+        std::istringstream in(std::move(r.data));
+        Record inner;
+        for (auto i = 0u; i < r.arg && read_record(in, inner); ++i)
+            fn(inner);
+    }
+
+    /**
+     * The durability of a call: `d` may raise the vector's level, except
+     * that a vector without a log stays without one.
+     */
+    durability effective(std::optional<durability> d) const
+    {
+        if (m_log)
+            return m_log->effective(d);
+        if (!d || m_durability == durability::memory)
+            return m_durability;
+        auto level = std::max(*d, m_durability);
+        if (m_stripes && level != durability::periodic)
+        {
+            throw std::invalid_argument(
+                "vector: a striped log is only flushed periodically");
+        }
+        return level;
+    }
+
+    /**
+     * Return once the record `id` is as durable as `level` asks for.
+     * Records are drained in id order, so waiting for `id` also waits for
+     * every earlier record still being staged by another thread.
+     */
+    void commit(uint64_t id, durability level)
+    {
+        if (m_log)
+        {
+            // Tickets are not ids, so wait for everything logged so far.
+            m_log->commit(m_log->m_last_id.load(), level);
+            return;
+        }
+        switch (level)
+        {
+        case durability::memory:
+        case durability::periodic:
+            return;
+        case durability::os_buffered:
+            while (true)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mtx);
+                    if (!drain() && !recover())
+                        exit(1);
+                    if (m_ring.next() > id)
+                        return;
+                }
+                std::this_thread::yield();
+            }
+        case durability::replicated:
+            commit(id, durability::group_commit);
+            // Only a socket carries acknowledgements back.
+            while (m_replica_fd >= 0 && m_replica_acks &&
+                   m_replica_acked.load() < id)
+            {
+                std::lock_guard<std::mutex> lock(m_replica_mtx);
+                if (m_replica_acked.load() < id && !receive_acks(true))
+                    throw std::runtime_error("vector: lost the follower");
+            }
+            return;
+        case durability::group_commit:
+        case durability::sync_per_op:
+        {
+            // Under group commit, whoever fsyncs first covers everybody
+            // queued behind it on the lock.
+            bool shared = level == durability::group_commit;
+            while (!shared || m_durable.load() <= id)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_mtx);
+                    if (!shared || m_durable.load() <= id)
+                    {
+                        if (!sync())
+                            exit(1);
+                    }
+                }
+                if (m_durable.load() > id)
+                    return;
+                shared = true;
+                std::this_thread::yield();
+            }
+            return;
+        }
+        }
+    }
+
+    /**
+     * `sync` for the flusher: measures how long the oldest pending record
+     * took to become durable and tunes the batch size towards the target
+     * latency.
+     */
+    bool flush()
+    {
+        bool pending = m_pending_records.load(std::memory_order_relaxed);
+        auto since = std::chrono::steady_clock::duration(
+            m_pending_since.load(std::memory_order_relaxed));
+        if (!sync())
+            return false;
+
+        auto target = std::chrono::microseconds(
+            m_flush_target.load(std::memory_order_relaxed));
+        if (!pending || target.count() == 0)
+            return true;
+
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        auto records = m_flush_records.load(std::memory_order_relaxed);
+        if (now - since > target)
+            records = std::max<std::size_t>(records / 2, 1);
+        else
+            records = std::min(records + records / 8 + 1, _max_batch);
+        m_flush_records.store(records, std::memory_order_relaxed);
+        return true;
+    }
+
+    static std::string segment_name(std::size_t index)
+    {
+        auto name = std::string(_filename);
+        if (index > 0)
+        {
+            name += ".seg";
+            name += std::to_string(index);
+        }
+        return name;
+    }
+
+    static std::string checkpoint_name(uint64_t id)
+    {
+        return std::string(_filename) + ".at" + std::to_string(id);
+    }
+
+    static std::string stripe_name(std::size_t index)
+    {
+        auto name = std::string(_filename);
+        name += '.';
+        name += std::to_string(index);
+        return name;
+    }
+
+    static std::vector<std::filesystem::path>
+    stripe_files(const std::filesystem::path& directory, const options& opts)
+    {
+        auto& directories = opts.stripe_directories;
+        auto count = opts.stripes ? opts.stripes : directories.size();
+        if (!directories.empty() && directories.size() != count)
+            throw std::invalid_argument("vector: one directory per stripe");
+
+        std::vector<std::filesystem::path> files;
+        for (auto i = 0u; i < count; ++i)
+        {
+            auto& dir = directories.empty() ? directory : directories[i];
+            files.push_back(dir / stripe_name(i));
+        }
+        return files;
+    }
+
+    /**
+     * Count a staged record and wake the flusher when it crosses one of the
+     * thresholds of the flush policy.
+     */
+    void notify_pending(std::initializer_list<std::string_view> parts)
+    {
+        std::size_t length = 0;
+        for (auto part : parts)
+            length += part.size();
+
+        auto crosses = [](std::size_t before, std::size_t added,
+                          std::size_t limit)
+        { return limit && before < limit && before + added >= limit; };
+
+        auto records = m_pending_records.fetch_add(1);
+        auto bytes = m_pending_bytes.fetch_add(length);
+        if (records == 0)
+        {
+            auto now = std::chrono::steady_clock::now().time_since_epoch();
+            m_pending_since.store(now.count(), std::memory_order_relaxed);
+        }
+        if (crosses(records, 1, m_flush_records.load()) ||
+            crosses(bytes, length, m_flush_bytes.load()))
+        {
+            if (m_flusher)
+                io_scheduler::shared().wake(m_flusher);
+        }
+    }
+    /**
+     * Replay the main log file, then the stripes, and continue ids after
+     * the last one replayed.
+     */
+    void load(const std::filesystem::path& filepath,
+              const std::vector<std::filesystem::path>& stripes,
+              uint64_t until = std::numeric_limits<uint64_t>::max())
+    {
+        // Nobody can read the vector yet, so replay into a plain vector and
+        // build the table once.
+        std::vector<std::unique_ptr<Item>> items;
+        uint64_t last_id = 0;
+        bool past = false;
+        auto apply = [&](Record& r)
+        {
+            if (r.header.type != ERASE && r.header.type != ERASE_RANGE)
+            {
+                if (r.header.id > until)
+                    past = true;
+                if (past)
+                    return false;
+                last_id = std::max(last_id, r.header.id);
+            }
+            if (r.header.type == NAME || r.header.type == VECTOR)
+            {
+                if (!m_route)
+                    throw std::runtime_error(filepath.string() +
+                                             " belongs to a store");
+                m_route(r);
+                return true;
+            }
+            if (r.header.type == PUSHBACK_TOKEN)
+                remember(r.arg, r.header.id);
+            apply_record(items, r);
+            return true;
+        };
+
+        // Every segment cuts off its predecessor where it was last synced. A
+        // queue deletes its oldest segments, so start at the first one left.
+        std::vector<std::pair<std::filesystem::path, uint64_t>> segments;
+        std::size_t start = 0;
+        if (std::filesystem::exists(filepath))
+            segments.emplace_back(filepath, 0);
+        else if (auto first = first_segment())
+        {
+            start = *first;
+            segments.emplace_back(m_directory / segment_name(start), 0);
+        }
+        while (!segments.empty())
+        {
+            auto path = m_directory / segment_name(start + segments.size());
+            auto cutoff = read_marker(path);
+            if (!cutoff)
+                break;
+            segments.emplace_back(path, *cutoff);
+        }
+        // Going back in time, skip what the latest checkpoint covers.
+        std::size_t first = 0;
+        uint64_t offset = 0;
+        if (auto checkpoint = load_checkpoint(until, items))
+        {
+            if (checkpoint->segment < start ||
+                checkpoint->segment >= start + segments.size())
+                throw std::runtime_error(filepath.string() + " is missing");
+            last_id = checkpoint->id;
+            first = checkpoint->segment - start;
+            offset = checkpoint->offset;
+        }
+        for (auto i = first; i < segments.size() && !past; ++i)
+        {
+            auto& path = segments[i].first;
+            auto limit = i + 1 < segments.size()
+                             ? segments[i + 1].second
+                             : std::numeric_limits<uint64_t>::max();
+            auto end =
+                load_from_file(path, apply, limit, i == first ? offset : 0);
+            if (i + 1 == segments.size())
+            {
+                // Cut off a torn record or the padding of `direct_log`, so
+                // that appends continue right after the last record.
+                if (!m_read_only &&
+                    until == std::numeric_limits<uint64_t>::max() &&
+                    std::filesystem::file_size(path) > end)
+                    std::filesystem::resize_file(path, end);
+                m_segment = start + i;
+                m_tail_offset = end;
+            }
+            else if (m_queue)
+            {
+                m_segment_ends.emplace_back(start + i, last_id);
+            }
+        }
+        if (!stripes.empty())
+        {
+            last_id = std::max(last_id, striped_log::replay<Record>(
+                                            stripes, read_record, apply));
+        }
+
+        adopt(items, last_id);
+        m_head_logged = m_durable_head =
+            items.empty() ? last_id + 1 : m_table.load()->get(0)->id;
+    }
+
+    /**
+     * The index of the oldest segment in the vector's directory, if any.
+     */
+    std::optional<std::size_t> first_segment() const
+    {
+        auto prefix = segment_name(1);
+        prefix.pop_back();
+        std::optional<std::size_t> first;
+        std::error_code ec;
+        for (auto& entry :
+             std::filesystem::directory_iterator(m_directory, ec))
+        {
+            auto name = entry.path().filename().string();
+            if (!name.starts_with(prefix))
+                continue;
+            std::size_t index = 0;
+            auto* last = name.data() + name.size();
+            auto [end, error] =
+                std::from_chars(name.data() + prefix.size(), last, index);
+            if (error == std::errc() && end == last &&
+                (!first || index < *first))
+                first = index;
+        }
+        return first;
+    }
+
+    /**
+     * Load the elements of the latest checkpoint at or before `until`, if
+     * any, into `items`. Only `open_at` asks for one.
+     */
+    std::optional<Checkpoint>
+    load_checkpoint(uint64_t until, std::vector<std::unique_ptr<Item>>& items)
+    {
+        if (until == std::numeric_limits<uint64_t>::max())
+            return std::nullopt;
+
+        auto prefix = checkpoint_name(0);
+        prefix.pop_back();
+        std::optional<uint64_t> latest;
+        for (auto& entry : std::filesystem::directory_iterator(m_directory))
+        {
+            auto name = entry.path().filename().string();
+            if (!name.starts_with(prefix))
+                continue;
+            uint64_t id = 0;
+            auto* last = name.data() + name.size();
+            auto [end, error] =
+                std::from_chars(name.data() + prefix.size(), last, id);
+            if (error == std::errc() && end == last && id <= until &&
+                (!latest || id > *latest))
+                latest = id;
+        }
+        if (!latest)
+            return std::nullopt;
+
+        auto path = m_directory / checkpoint_name(*latest);
+        auto ifs = std::ifstream(path, std::ios::binary);
+        Checkpoint checkpoint;
+        if (!ifs.read(reinterpret_cast<char*>(&checkpoint), sizeof(checkpoint)))
+            throw std::runtime_error("Failed to read " + path.string());
+        Record r;
+        for (auto i = 0u; i < checkpoint.size; ++i)
+        {
+            if (!read_record(ifs, r) || r.header.type != PUSHBACK)
+                throw std::runtime_error("Failed to read " + path.string());
+            apply_record(items, r);
+        }
+        return checkpoint;
+    }
+
+    /**
+     * Take over the replayed `items` and continue after `last_id`.
+     */
+    void adopt(std::vector<std::unique_ptr<Item>>& items, uint64_t last_id)
+    {
+        auto* table = m_table.load(std::memory_order_relaxed);
+        for (auto i = 0u; i < items.size(); ++i)
+            table->reserve(i).store(items[i].release(),
+                                    std::memory_order_relaxed);
+        table->size.store(items.size(), std::memory_order_relaxed);
+
+        m_last_id = last_id;
+        m_base_id = last_id + 1;
+        m_base_index = items.size();
+        m_ring.reset(last_id + 1);
+        m_durable = last_id + 1;
+        m_ticketed = last_id;
+    }
+
+    /**
+     * Where the previous segment is cut off according to the marker at the
+     * start of `path`, if it is a complete segment.
+     */
+    static std::optional<uint64_t>
+    read_marker(const std::filesystem::path& path)
+    {
+        auto ifs = std::ifstream(path, std::ios::binary);
+        Record marker;
+        if (!ifs || !read_record(ifs, marker) || marker.header.type != SEGMENT)
+            return std::nullopt;
+        return marker.header.rindex;
+    }
+
+    /**
+     * Apply every record in `filepath` from `offset` on that ends within
+     * `limit` bytes, until `apply` returns false, and return where the last
+     * one applied ends.
+     */
+    template <typename Apply>
+    uint64_t load_from_file(const std::filesystem::path& filepath, Apply apply,
+                            uint64_t limit, uint64_t offset = 0)
+    {
+        auto ifs = std::ifstream(filepath, std::ios::binary);
+        if (!ifs)
+        {
+            throw std::runtime_error("Failed to open " + filepath.string() +
+                                     " for reading.");
+        }
+        // Stop loading if file has an error
+        Record record;
+        uint64_t end = offset;
+        ifs.seekg(offset);
+        while (read_record(ifs, record) && uint64_t(ifs.tellg()) <= limit)
+        {
+            if (!apply(record))
+                break;
+            end = ifs.tellg();
+        }
+        return end;
+    }
+
+    /**
+     * Read the next record from `in`. Fails on a torn or unknown record.
+     */
+    static bool read_record(std::istream& in, Record& r)
+    {
+        auto read = [&](auto& v)
+        { return bool(in.read(reinterpret_cast<char*>(&v), sizeof(v))); };
+
+        if (!read(r.header))
+            return false;
+        switch (r.header.type)
+        {
+        case ERASE:
+        case CLEAR:
+        case SEGMENT:
+        case HEAD:
+            return true;
+        case ERASE_RANGE:
+            return read(r.arg);
+        case TRANSACTION:
+        {
+            if (!read(r.arg) || r.header.dsize > _max_transaction)
+                return false;
+            r.data.resize(r.header.dsize);
+            Header commit;
+            return in.read(r.data.data(), r.header.dsize) && read(commit) &&
+                   commit.type == COMMIT && commit.id == r.header.id &&
+                   commit.rindex == r.arg;
+        }
+        case NAME:
+        case VECTOR:
+        case INSERT:
+        case SET:
+        case PUSHBACK_TOKEN:
+            if (!read(r.arg))
+                return false;
+            [[fallthrough]];
+        case PUSHBACK:
+        {
+            // A VECTOR record wraps one of the others.
+            auto limit = r.header.type == VECTOR ? 4_KB + 32 : 4_KB;
+            if (r.header.dsize > limit)
+                return false;
+            r.data.resize(r.header.dsize);
+            return bool(in.read(r.data.data(), r.header.dsize));
+        }
+        }
+        return false;
+    }
+
+    static void apply_record(std::vector<std::unique_ptr<Item>>& items,
+                             Record& r)
+    {
+        auto& header = r.header;
+        switch (header.type)
+        {
+        case ERASE:
+            assert(items.at(header.rindex)->id == header.id);
+            items.erase(items.begin() + header.rindex);
+            break;
+        case ERASE_RANGE:
+        {
+            assert(items.at(header.rindex)->id == header.id);
+            auto it = items.begin() + header.rindex;
+            items.erase(it, it + r.arg);
+            break;
+        }
+        case CLEAR:
+            items.clear();
+            break;
+        case HEAD:
+        {
+            auto it = std::ranges::find_if(
+                items, [&](auto& item) { return item->id >= header.rindex; });
+            items.erase(items.begin(), it);
+            break;
+        }
+        case PUSHBACK:
+        case PUSHBACK_TOKEN:
+            items.push_back(
+                std::make_unique<Item>(header.id, std::move(r.data)));
+            break;
+        case INSERT:
+            items.insert(items.begin() + r.arg,
+                         std::make_unique<Item>(header.id, std::move(r.data)));
+            break;
+        case SET:
+            items.at(r.arg) =
+                std::make_unique<Item>(header.id, std::move(r.data));
+            break;
+        case TRANSACTION:
+            for_each_in(r, [&](Record& inner) { apply_record(items, inner); });
+            break;
+        }
+    }
+};
+
+/**
+ * Many named vectors in one directory, sharing one log and its flusher.
+ *
+ * Every record of a vector is wrapped in a VECTOR record of the shared log
+ * together with the vector's number; a NAME record introduces each name.
+ */
+class store
+{
+public:
+    /**
+     * Open the store in `directory`; `opts` apply to the shared log.
+     */
+    explicit store(const std::filesystem::path& directory,
+                   const vector::options& opts = {})
+        : m_log(directory, opts,
+                [this](vector::Record& r)
+                {
+                    if (r.header.type == vector::NAME)
+                        m_numbers[std::move(r.data)] = r.arg;
+                    else
+                        m_records[r.arg].push_back(std::move(r));
+                })
+    {
+        for (auto& [name, number] : m_numbers)
+            m_next = std::max(m_next, number + 1);
+    }
+
+    store(const store&) = delete;
+    store& operator=(const store&) = delete;
+
+    /**
+     * The vector called `name`, created empty if there is none yet. Safe to
+     * call from any thread; the vector lives as long as the store.
+     */
+    vector& open(std::string_view name)
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        auto it = m_numbers.find(name);
+        if (it == m_numbers.end())
+        {
+            it = m_numbers.emplace(std::string(name), m_next++).first;
+            m_log.stage_for(vector::NAME, it->second, name);
+        }
+
+        auto number = it->second;
+        auto& v = m_vectors[number];
+        if (!v)
+        {
+            auto records = std::move(m_records[number]);
+            m_records.erase(number);
+            v.reset(new vector(m_log, number, std::move(records)));
+        }
+        return *v;
+    }
+
+private:
+    // Filled while `m_log` replays, so they come first.
+    std::mutex m_mtx;
+    std::map<std::string, uint64_t, std::less<>> m_numbers;
+    uint64_t m_next = 1;
+    // Replayed records of the vectors that were not opened yet.
+    std::map<uint64_t, std::vector<vector::Record>> m_records;
+
+    vector m_log;
+    // Destroyed before the log they write to.
+    std::map<uint64_t, std::unique_ptr<vector>> m_vectors;
+};
+
+static_assert(std::ranges::random_access_range<const vector>);
+static_assert(std::ranges::random_access_range<const vector::snapshot_view>);
+
+std::size_t errors = 0;
+
+#define ERROR(msg)                                                             \
+    {                                                                          \
+        std::cout << __FILE__ << ":" << __LINE__ << " " << msg << "\n";        \
+        ++errors;                                                              \
+    }
+#define CHECK(x)                                                               \
+    do                                                                         \
+        if (!(x))                                                              \
+        {                                                                      \
+            ERROR(#x " failed");                                               \
+        }                                                                      \
+    while (false)
+
+constexpr unsigned LOOP_COUNT = 100000;
+
+std::string all_chars()
+{
+    std::string rv;
+    for (char c = std::numeric_limits<char>::min();
+         c != std::numeric_limits<char>::max(); ++c)
+    {
+        rv += c;
+    }
+
+    rv += std::numeric_limits<char>::max();
+    return rv;
+}
+
+std::string chars_4K(char v)
+{
+    std::string rv(4_KB, v);
+    return rv;
+}
+
+void run_test_one(const std::filesystem::path& p)
+{
+    vector v(p);
+    using namespace std::literals;
+
+    v.push_back("foo");
+    CHECK(v.at(0) == "foo");
+    CHECK(v.size() == 1);
+
+    v.push_back(all_chars());
+    CHECK(v.at(1) == all_chars());
+    CHECK(v.size() == 2);
+
+    auto start = std::chrono::system_clock::now();
+    for (auto i = 0u; i < LOOP_COUNT; ++i)
+    {
+        std::stringstream s;
+        s << "loop " << i;
+        v.push_back(s.str());
+    }
+    auto end = std::chrono::system_clock::now();
+    std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(end -
+                                                                       start)
+                     .count()
+              << " ms" << std::endl;
+    CHECK((end - start) / 1s < 1);
+    CHECK(v.size() == LOOP_COUNT + 2);
+}
+
+void run_test_two(const std::filesystem::path& p)
+{
+    vector v(p);
+
+    CHECK(v.size() == LOOP_COUNT + 2);
+    CHECK(v.at(0) == "foo");
+    CHECK(v.at(1) == all_chars());
+    CHECK(v.at(873) == "loop 871");
+
+    v.erase(873);
+    CHECK(v.size() == LOOP_COUNT + 1);
+    CHECK(v.at(0) == "foo");
+    CHECK(v.at(1) == all_chars());
+    CHECK(v.at(873) == "loop 872");
+}
+
+void run_test_three(const std::filesystem::path& p)
+{
+    vector v(p);
+
+    CHECK(v.size() == LOOP_COUNT + 1);
+    CHECK(v.at(0) == "foo");
+    CHECK(v.at(1) == all_chars());
+    CHECK(v.at(873) == "loop 872");
+
+    v.erase(873);
+    CHECK(v.size() == LOOP_COUNT);
+    CHECK(v.at(0) == "foo");
+    CHECK(v.at(1) == all_chars());
+    CHECK(v.at(873) == "loop 873");
+}
+
+void run_test_four(const std::filesystem::path& p)
+{
+    vector v(p);
+    using namespace std::literals;
+
+    v.clear();
+    CHECK(v.size() == 0);
+
+    auto start = std::chrono::system_clock::now();
+    for (auto i = 0u; i < LOOP_COUNT; ++i)
+    {
+        v.push_back(chars_4K(i));
+        CHECK(v.at(i) == chars_4K(i));
+        CHECK(v.size() == i + 1);
+    }
+    auto end = std::chrono::system_clock::now();
+    std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(end -
+                                                                       start)
+                     .count()
+              << " ms" << std::endl;
+    CHECK((end - start) / 1s < 1);
+    CHECK(v.size() == LOOP_COUNT);
+}
+
+void run_test_five(const std::filesystem::path& p)
+{
+    {
+        vector v(p);
+        for (auto i = 0u; i < 10; ++i)
+            v.push_back(std::to_string(i));
+
+        v.erase(2, 5);
+        CHECK(v.size() == 7);
+        CHECK(v.at(1) == "1");
+        CHECK(v.at(2) == "5");
+
+        v.erase(3, 3);
+        CHECK(v.size() == 7);
+    }
+    {
+        vector v(p);
+        CHECK(v.size() == 7);
+        CHECK(v.at(2) == "5");
+        CHECK(v.at(6) == "9");
+
+        v.clear();
+        CHECK(v.size() == 0);
+        v.push_back("after clear");
+    }
+    {
+        vector v(p);
+        CHECK(v.size() == 1);
+        CHECK(v.at(0) == "after clear");
+    }
+}
+
+void run_test_six(const std::filesystem::path& p)
+{
+    {
+        vector v(p);
+        v.push_back("a");
+        v.push_back("c");
+        v.insert(1, "b");
+        v.insert(3, "d");
+        v.insert(0, "_");
+        CHECK(v.size() == 5);
+        CHECK(v.at(0) == "_");
+        CHECK(v.at(2) == "b");
+        CHECK(v.at(4) == "d");
+
+        v.set(0, "z");
+        CHECK(v.at(0) == "z");
+        CHECK(v.size() == 5);
+    }
+    {
+        vector v(p);
+        CHECK(v.size() == 5);
+        CHECK(v.at(0) == "z");
+        CHECK(v.at(1) == "a");
+        CHECK(v.at(2) == "b");
+        CHECK(v.at(3) == "c");
+        CHECK(v.at(4) == "d");
+    }
+}
+
+void run_test_seven(const std::filesystem::path& p)
+{
+    using namespace std::literals;
+    const std::byte bytes[] = {std::byte{0}, std::byte{'x'}, std::byte{0xFF}};
+
+    {
+        vector v(p);
+        std::string s = "moved";
+        v.push_back(std::move(s));
+        v.push_back("view"sv);
+        v.push_back(std::span<const std::byte>(bytes));
+        CHECK(v.at(0) == "moved");
+        CHECK(v.at(1) == "view");
+        CHECK(v.at(2) == "\0x\xFF"sv);
+    }
+    {
+        vector v(p);
+        CHECK(v.size() == 3);
+        CHECK(v.at(0) == "moved");
+        CHECK(v.at(1) == "view");
+        CHECK(v.at(2) == "\0x\xFF"sv);
+    }
+}
+
+void run_test_eight(const std::filesystem::path& p)
+{
+    vector v(p);
+    for (auto i = 0u; i < 100_KB; ++i)
+        v.push_back(std::to_string(i));
+
+    CHECK(*v.begin() == "0");
+    CHECK(v.begin()[42] == "42");
+    CHECK(v.end() - v.begin() == 100_KB);
+    CHECK(std::ranges::find(v, "1234") - v.begin() == 1234);
+
+    std::size_t count = 0;
+    for (auto s : v | std::views::drop(10))
+        count += !s.empty();
+    CHECK(count == 100_KB - 10);
+
+    std::atomic<std::size_t> total = 0;
+    v.parallel_for_each([&](std::string_view s) { total += s.size(); }, 4);
+    std::size_t expected = 0;
+    for (auto s : v)
+        expected += s.size();
+    CHECK(total == expected);
+
+    bool thrown = false;
+    try
+    {
+        v.parallel_for_each(
+            [](std::string_view s)
+            {
+                if (s == "99999")
+                    throw std::runtime_error(std::string(s));
+            },
+            4);
+    }
+    catch (const std::runtime_error& e)
+    {
+        thrown = e.what() == std::string("99999");
+    }
+    CHECK(thrown);
+}
+
+void run_test_nine(const std::filesystem::path& p)
+{
+    vector v(p);
+    for (auto i = 0u; i < 1000; ++i)
+        v.push_back(std::to_string(i));
+
+    const std::size_t indices[] = {999, 3, 500, 3, 0, 42};
+    std::string_view out[std::size(indices)];
+    v.at_many(indices, out);
+    for (auto i = 0u; i < std::size(indices); ++i)
+        CHECK(out[i] == v.at(indices[i]));
+
+    bool thrown = false;
+    const std::size_t bad[] = {1, 1000};
+    try
+    {
+        v.at_many(bad, out);
+    }
+    catch (const std::out_of_range&)
+    {
+        thrown = true;
+    }
+    CHECK(thrown);
+}
+
+void run_test_ten(const std::filesystem::path& p)
+{
+    vector v(p);
+    v.push_back("x");
+
+    std::atomic<bool> done = false;
+    std::atomic<std::size_t> bad = 0;
+    std::vector<std::jthread> readers;
+    for (auto t = 0u; t < 4; ++t)
+    {
+        readers.emplace_back(
+            [&]
+            {
+                while (!done)
+                {
+                    auto guard = v.pin();
+                    auto n = v.size();
+                    try
+                    {
+                        auto s = v.at(n - 1);
+                        bad += s.empty() || s[0] != 'x';
+                    }
+                    catch (const std::out_of_range&)
+                    {
+                        // Shrunk between size() and at().
+                    }
+                }
+            });
+    }
+
+    for (auto i = 0u; i < 20000; ++i)
+    {
+        v.push_back(std::string(1, 'x').append(std::to_string(i)));
+        if (i % 7 == 0)
+            v.set(v.size() - 1, "x set");
+        if (i % 100 == 0)
+            v.erase(0, v.size() / 2);
+        if (i % 1000 == 0)
+            v.clear(), v.push_back("x");
+    }
+    done = true;
+    readers.clear();
+
+    CHECK(bad == 0);
+}
+
+void run_test_eleven(const std::filesystem::path& p)
+{
+    constexpr unsigned producers = 4;
+    constexpr unsigned count = 20000;
+    std::vector<std::string> expected;
+    {
+        vector v(p);
+        {
+            std::vector<std::jthread> threads;
+            for (auto t = 0u; t < producers; ++t)
+            {
+                threads.emplace_back(
+                    [&v, t]
+                    {
+                        for (auto i = 0u; i < count; ++i)
+                        {
+                            v.push_back(std::to_string(t * count + i));
+                            if (t == 0 && i % 5000 == 0)
+                                v.erase(0);
+                        }
+                    });
+            }
+        }
+        CHECK(v.size() == producers * count - count / 5000);
+
+        // Every producer's elements keep their relative order.
+        std::vector<unsigned> last(producers, 0);
+        bool ordered = true;
+        for (auto s : v)
+        {
+            auto n = std::stoul(std::string(s));
+            ordered = ordered && n >= last[n / count];
+            last[n / count] = n;
+        }
+        CHECK(ordered);
+        for (auto s : v)
+            expected.emplace_back(s);
+    }
+    {
+        vector v(p);
+        CHECK(std::ranges::equal(v, expected));
+    }
+}
+
+void run_test_twelve(const std::filesystem::path& p)
+{
+    auto opts = vector::options{.stripes = 3};
+    std::vector<std::string> expected;
+    {
+        vector v(p, opts);
+        std::vector<std::jthread> threads;
+        for (auto t = 0u; t < 3; ++t)
+        {
+            threads.emplace_back(
+                [&v, t]
+                {
+                    for (auto i = 0u; i < 10000; ++i)
+                        v.push_back(std::to_string(t * 10000 + i));
+                });
+        }
+    }
+    {
+        vector v(p, opts);
+        CHECK(v.size() == 30000);
+        for (auto s : v)
+            expected.emplace_back(s);
+    }
+
+    bool thrown = false;
+    try
+    {
+        vector v(p);
+    }
+    catch (const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    CHECK(thrown);
+
+    // Lose the tail of one stripe, as if it was not synced before a crash:
+    // everything up to the first lost record is still there.
+    auto stripe = p / ".vector.bin.1";
+    std::filesystem::resize_file(stripe,
+                                 std::filesystem::file_size(stripe) - 5);
+    {
+        vector v(p, opts);
+        CHECK(v.size() < expected.size());
+        CHECK(std::ranges::equal(v, expected | std::views::take(v.size())));
+
+        v.erase(10, 20);
+        v.insert(0, "first");
+        v.push_back("after crash");
+        expected.clear();
+        for (auto s : v)
+            expected.emplace_back(s);
+    }
+    {
+        vector v(p, opts);
+        CHECK(std::ranges::equal(v, expected));
+        CHECK(v.at(0) == "first");
+        CHECK(v.at(v.size() - 1) == "after crash");
+    }
+}
+
+void run_test_thirteen(const std::filesystem::path& p)
+{
+    vector::snapshot_view outlived;
+    {
+        vector v(p);
+        for (auto i = 0u; i < 1000; ++i)
+            v.push_back(std::to_string(i));
+
+        auto snap = v.snapshot();
+        v.push_back("appended");
+        v.set(0, "set");
+        v.erase(1, 10);
+        v.insert(0, "inserted");
+        CHECK(snap.size() == 1000);
+        CHECK(snap.at(0) == "0");
+        CHECK(snap.at(5) == "5");
+        CHECK(snap.at(999) == "999");
+        CHECK(v.at(0) == "inserted");
+        CHECK(v.at(1) == "set");
+
+        auto copy = snap;
+        v.clear();
+        CHECK(std::ranges::equal(copy, snap));
+        CHECK(*(copy.end() - 1) == "999");
+
+        v.push_back("after clear");
+        outlived = v.snapshot();
+        v.set(0, "changed");
+    }
+    CHECK(outlived.size() == 1);
+    CHECK(outlived.at(0) == "after clear");
+}
+
+void run_test_fourteen(const std::filesystem::path& p)
+{
+    auto file = p / ".vector.bin";
+    auto flushed = [&]
+    {
+        for (auto i = 0; i < 1000; ++i)
+        {
+            if (std::filesystem::file_size(file) > 0)
+                return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return false;
+    };
+
+    vector::options opts;
+    opts.flush = {.interval = std::chrono::hours(1), .bytes = 0, .records = 0};
+    vector v(p, opts);
+    CHECK(v.get_flush_policy().interval == std::chrono::hours(1));
+
+    // Let the flusher settle into its wait first.
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    v.push_back("staged");
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    CHECK(std::filesystem::file_size(file) == 0);
+
+    v.set_flush_policy({.interval = std::chrono::hours(1), .records = 2});
+    v.push_back("second");
+    CHECK(flushed());
+
+    std::filesystem::resize_file(file, 0);
+    v.set_flush_policy({.interval = std::chrono::hours(1), .bytes = 4_KB});
+    v.push_back(std::string(4_KB, 'x'));
+    CHECK(flushed());
+
+    std::filesystem::resize_file(file, 0);
+    v.set_flush_policy({.interval = std::chrono::milliseconds(1),
+                        .bytes = 0,
+                        .records = 0});
+    v.push_back("timer");
+    CHECK(flushed());
+}
+
+void run_test_fifteen(const std::filesystem::path& p)
+{
+    vector::options opts;
+    opts.flush = {.bytes = 0, .records = 64};
+    vector v(p, opts);
+
+    // Nothing can be durable within a microsecond, so batches shrink.
+    v.set_flush_policy({.bytes = 0,
+                        .records = 64,
+                        .target_latency = std::chrono::microseconds(1)});
+    for (auto i = 0u; i < 1000; ++i)
+    {
+        v.push_back(std::to_string(i));
+        if (i % 16 == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    CHECK(v.get_flush_policy().records < 64);
+
+    // Everything is durable within an hour, so batches grow.
+    v.set_flush_policy({.bytes = 0,
+                        .records = 4,
+                        .target_latency = std::chrono::hours(1)});
+    for (auto i = 0u; i < 1000; ++i)
+    {
+        v.push_back(std::to_string(i));
+        if (i % 16 == 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    CHECK(v.get_flush_policy().records > 4);
+}
+
+void run_test_sixteen(const std::filesystem::path& p)
+{
+    using durability = vector::durability;
+    auto file = p / ".vector.bin";
+
+    {
+        vector v(p, {.level = durability::memory});
+        v.push_back("scratch", durability::sync_per_op);
+        CHECK(v.at(0) == "scratch");
+    }
+    CHECK(!std::filesystem::exists(file));
+
+    {
+        vector v(p, {.level = durability::os_buffered});
+        v.push_back("buffered");
+        CHECK(std::filesystem::file_size(file) > 0);
+    }
+
+    std::filesystem::resize_file(file, 0);
+    {
+        vector::options opts;
+        opts.flush = {.interval = std::chrono::hours(1), .bytes = 0,
+                      .records = 0};
+        vector v(p, opts);
+        v.push_back("critical", durability::sync_per_op);
+        CHECK(std::filesystem::file_size(file) > 0);
+
+        std::filesystem::resize_file(file, 0);
+        v.erase(0, durability::group_commit);
+        CHECK(std::filesystem::file_size(file) > 0);
+    }
+
+    std::filesystem::remove(file);
+    {
+        vector v(p, {.level = durability::group_commit});
+        std::vector<std::jthread> threads;
+        for (auto t = 0u; t < 4; ++t)
+            threads.emplace_back(
+                [&]
+                {
+                    for (auto i = 0u; i < 100; ++i)
+                        v.push_back(std::to_string(i));
+                });
+        threads.clear();
+        v.set(0, "set");
+        v.clear();
+        auto size = std::filesystem::file_size(file);
+        // 400 appends, a SET of "set" and a CLEAR.
+        CHECK(size == 400 * 24 + 4 * 190 + (24 + 8 + 3) + 24);
+    }
+
+    bool threw = false;
+    try
+    {
+        vector v(p, {.level = durability::sync_per_op, .stripes = 2});
+    }
+    catch (const std::invalid_argument&)
+    {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+void run_test_seventeen(const std::filesystem::path& p)
+{
+    using durability = vector::durability;
+    using sync_method = vector::sync_method;
+
+    auto n = 0u;
+    for (auto method :
+         {sync_method::fsync, sync_method::fdatasync, sync_method::dsync})
+    {
+        vector::options opts;
+        opts.sync = method;
+        opts.writeback = 64;
+        opts.preallocate = 64_KB;
+        vector v(p, opts);
+        for (auto i = 0u; i < 100; ++i)
+            v.push_back(std::to_string(n++));
+        v.push_back(std::to_string(n++), durability::sync_per_op);
+
+        // Preallocating does not change the size of the log.
+        CHECK(std::filesystem::file_size(p / ".vector.bin") < 64_KB);
+        CHECK(v.size() == n);
+    }
+
+    vector v(p);
+    CHECK(v.size() == n);
+    CHECK(v.at(n - 1) == std::to_string(n - 1));
+}
+
+void run_test_eighteen(const std::filesystem::path& p)
+{
+    using durability = vector::durability;
+    auto file = p / ".vector.bin";
+    std::vector<std::string> expected;
+    auto value = [&](std::size_t i)
+    { return std::string(i % 7 == 0 ? 4_KB : i % 100, char('a' + i % 26)); };
+
+    for (auto round = 0u; round < 2; ++round)
+    {
+        vector v(p, {.direct = true});
+        for (auto i = 0u; i < 500; ++i)
+        {
+            expected.push_back(value(expected.size()));
+            v.push_back(expected.back());
+        }
+        expected.push_back("tail");
+        v.push_back("tail", durability::sync_per_op);
+        CHECK(std::filesystem::file_size(file) % 4_KB == 0);
+        v.erase(3);
+        expected.erase(expected.begin() + 3);
+    }
+
+    {
+        // Reopening cuts off the padding, so buffered appends follow on.
+        vector v(p);
+        CHECK(std::ranges::equal(v, expected));
+        v.push_back("buffered");
+        expected.push_back("buffered");
+    }
+
+    vector v(p, {.direct = true});
+    CHECK(std::ranges::equal(v, expected));
+}
+
+void run_test_nineteen(const std::filesystem::path& p)
+{
+    using durability = vector::durability;
+    std::vector<std::string> expected;
+    {
+        vector::options opts;
+        opts.flush = {.interval = std::chrono::hours(1), .bytes = 0,
+                      .records = 0};
+        vector v(p, opts);
+        auto push = [&](durability d)
+        {
+            expected.push_back(std::string(100, char('a' + expected.size())));
+            v.push_back(expected.back(), d);
+        };
+        for (auto i = 0u; i < 10; ++i)
+            push(durability::periodic);
+        push(durability::sync_per_op);
+
+        // Writes past 2KB fail with EFBIG, so the log has to continue in a
+        // new segment.
+        std::signal(SIGXFSZ, SIG_IGN);
+        rlimit limit;
+        getrlimit(RLIMIT_FSIZE, &limit);
+        auto lowered = limit;
+        lowered.rlim_cur = 2_KB;
+        setrlimit(RLIMIT_FSIZE, &lowered);
+        for (auto i = 0u; i < 10; ++i)
+            push(durability::periodic);
+        push(durability::sync_per_op);
+        setrlimit(RLIMIT_FSIZE, &limit);
+        std::signal(SIGXFSZ, SIG_DFL);
+
+        CHECK(std::filesystem::exists(p / ".vector.bin.seg1"));
+        v.erase(0);
+        expected.erase(expected.begin());
+        push(durability::periodic);
+    }
+
+    vector v(p);
+    CHECK(std::ranges::equal(v, expected));
+}
+
+void run_test_twenty(const std::filesystem::path& p)
+{
+    constexpr unsigned count = 200;
+    std::vector<std::string> expected;
+    auto name = [](unsigned i)
+    {
+        auto name = std::string("v");
+        name += std::to_string(i);
+        return name;
+    };
+    {
+        store s(p);
+        std::vector<std::jthread> threads;
+        for (auto t = 0u; t < 4; ++t)
+            threads.emplace_back(
+                [&, t]
+                {
+                    for (auto i = t; i < count; i += 4)
+                    {
+                        auto& v = s.open(name(i));
+                        for (auto k = 0u; k <= i % 10; ++k)
+                            v.push_back(std::to_string(k));
+                    }
+                });
+        threads.clear();
+
+        // Concurrent appends to one vector of the store.
+        auto& shared = s.open("shared");
+        for (auto t = 0u; t < 4; ++t)
+            threads.emplace_back(
+                [&, t]
+                {
+                    for (auto i = 0u; i < 1000; ++i)
+                        shared.push_back(std::to_string(t * 1000 + i));
+                });
+        threads.clear();
+        for (auto item : shared)
+            expected.emplace_back(item);
+
+        auto& v = s.open("v3");
+        v.erase(0);
+        v.set(0, "set");
+        CHECK(&s.open("v3") == &v);
+    }
+    CHECK(std::distance(std::filesystem::directory_iterator(p),
+                        std::filesystem::directory_iterator()) == 1);
+
+    bool threw = false;
+    try
+    {
+        vector v(p);
+    }
+    catch (const std::runtime_error&)
     {
-        std::filesystem::path filepath;
-        filepath = directory / _filename;
+        threw = true;
+    }
+    CHECK(threw);
 
-        if (std::filesystem::exists(filepath))
+    store s(p);
+    for (auto i = 0u; i < count; ++i)
+    {
+        auto& v = s.open(name(i));
+        if (i == 3)
         {
-            load_from_file(filepath);
+            CHECK(v.size() == 3);
+            CHECK(v.at(0) == "set");
+            CHECK(v.at(2) == "3");
+            continue;
         }
+        CHECK(v.size() == i % 10 + 1);
+        CHECK(v.at(i % 10) == std::to_string(i % 10));
+    }
+    CHECK(s.open("new").size() == 0);
+    CHECK(std::ranges::equal(s.open("shared"), expected));
+}
 
-        m_ofs.open(filepath, std::ios::binary | std::ios::app);
-        // m_ofs << std::nounitbuf; //
+void run_test_twenty_one(const std::filesystem::path& p)
+{
+    auto& scheduler = io_scheduler::shared();
+    scheduler.set_workers(4);
+    CHECK(scheduler.workers() == 4);
 
-        if (!m_ofs)
+    // Short-lived vectors cost no thread of their own.
+    vector::options opts;
+    opts.flush = {.interval = std::chrono::hours(1), .bytes = 0,
+                  .records = 1};
+    for (auto round = 0u; round < 3; ++round)
+    {
+        std::vector<std::unique_ptr<vector>> vectors;
+        for (auto i = 0u; i < 50; ++i)
         {
-            throw std::runtime_error("Failed to open " + filepath.string() +
-                                     " for reading.");
+            auto dir = p / std::to_string(i);
+            std::filesystem::create_directory(dir);
+            vectors.push_back(std::make_unique<vector>(dir, opts));
+            vectors.back()->push_back(std::to_string(round));
         }
 
-        m_bg_thread = std::jthread(
-            [this](std::stop_token stoken)
+        // Each push crossed the record threshold and woke a worker.
+        for (auto i = 0u; i < 50; ++i)
+        {
+            auto file = p / std::to_string(i) / ".vector.bin";
+            auto expected = 24 + 1 + 25 * round;
+            for (auto k = 0; k < 1000; ++k)
             {
-                std::unique_lock lock(m_mtx);
-                while (!stoken.stop_requested())
-                {
-                    m_cv.wait_for( //
-                        lock, std::chrono::milliseconds(1000),
-                        [&]
-                        {
-                            // std::cout << "lambda start" << std::endl;
-                            bool stop_requested = stoken.stop_requested();
-                            if (!stop_requested)
-                            {
-                                m_ofs.flush();
-                                // https://man7.org/linux/man-pages/man2/close.2.html
-                                if (fsync(GetFileDescriptor(m_ofs)))
-                                    exit(1);
-                            }
-                            // std::cout << "lambda end" << std::endl;
-                            return stop_requested;
-                        });
-                    // std::cout << "end" << std::endl;
-                    m_ofs.flush();
-                    if (fsync(GetFileDescriptor(m_ofs)))
-                        exit(1);
-                }
-            });
-    }
-    ~vector()
-    {
-        m_bg_thread.request_stop();
-        m_cv.notify_all();
-        m_bg_thread.join();
+                if (std::filesystem::file_size(file) == expected)
+                    break;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            CHECK(std::filesystem::file_size(file) == expected);
+        }
     }
 
-    vector(const vector& v) = delete;
-    vector& operator=(const vector& v) = delete;
+    scheduler.set_workers(1);
+    CHECK(scheduler.workers() == 1);
+    vector v(p / "0");
+    CHECK(v.size() == 3);
+}
 
-    vector(vector&& v) noexcept { *this = std::move(v); }
-    vector& operator=(vector&& v) noexcept
-    {
-        if (this != &v)
-        {
-            m_data = std::exchange(v.m_data, std::vector<Item>{});
-        }
-        return *this;
-    }
+void run_test_twenty_two(const std::filesystem::path& p)
+{
+    using durability = vector::durability;
+    auto primary_dir = p / "primary";
+    auto follower_dir = p / "follower";
+    std::filesystem::create_directory(primary_dir);
+    std::filesystem::create_directory(follower_dir);
+
+    int fds[2];
+    CHECK(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
 
-    void push_back(const std::string& v)
+    std::vector<std::string> expected;
     {
-        uint64_t id;
-        id = ++m_last_id;
+        vector follower(follower_dir);
+        std::jthread follow([&] { follower.follow(fds[1]); });
 
-        auto length = v.size();
-        assert(length <= 4_KB);
-        {
-            std::lock_guard<std::mutex> lock(m_mtx);
-            // std::cout << "[push_back]" << std::endl;
+        vector primary(primary_dir);
+        for (auto i = 0u; i < 100; ++i)
+            primary.push_back(std::to_string(i));
+        primary.replicate_to(fds[0]);
 
-            auto header = Header{.type = PUSHBACK, .id = id, .dsize = length};
-            m_ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
-            m_ofs.write(v.data(), v.size());
-            // m_ofs.flush();
-        }
-        periodic_notify(id);
+        std::vector<std::jthread> writers;
+        for (auto t = 0u; t < 4; ++t)
+            writers.emplace_back(
+                [&, t]
+                {
+                    for (auto i = 0u; i < 500; ++i)
+                        primary.push_back(std::to_string(t * 1000 + i));
+                });
+        writers.clear();
+        primary.erase(0);
+        primary.erase(10, 20);
+        primary.insert(5, "inserted");
+        primary.set(6, "set");
+
+        primary.push_back("acked", durability::replicated);
+        CHECK(follower.size() == primary.size());
+        CHECK(follower.at(follower.size() - 1) == "acked");
 
-        m_data.emplace_back(id, v);
+        for (auto item : primary)
+            expected.emplace_back(item);
+        ::shutdown(fds[0], SHUT_RDWR);
+        follow.join();
+        CHECK(std::ranges::equal(follower, expected));
     }
+    ::close(fds[0]);
+    ::close(fds[1]);
 
-    std::string_view at(std::size_t index) const
+    // The follower persisted everything, ready to take over.
+    vector v(follower_dir);
+    CHECK(std::ranges::equal(v, expected));
+    v.push_back("taken over");
+}
+
+void run_test_twenty_three(const std::filesystem::path& p)
+{
+    using durability = vector::durability;
+    vector::options follow;
+    follow.read_only = true;
+    follow.flush.interval = std::chrono::milliseconds(1);
+
+    // Following an empty directory does not create the log.
     {
-        return std::string_view(m_data.at(index).str);
+        vector reader(p, follow);
+        CHECK(reader.size() == 0);
+        CHECK(reader.refresh() == 0);
     }
+    CHECK(!std::filesystem::exists(p / ".vector.bin"));
 
-    void erase(std::size_t index)
-    {
-        auto it = m_data.begin() + index;
-        {
-            std::lock_guard<std::mutex> lock(m_mtx);
-            // std::cout << "[erase]" << std::endl;
-            auto header = Header{.type = ERASE, .id = it->id, .rindex = index};
-            // m_ofs.flush();
-            m_ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
-        }
-        periodic_notify(++m_last_id);
+    vector::options write;
+    write.level = durability::os_buffered;
+    vector writer(p, write);
+    for (auto i = 0u; i < 100; ++i)
+        writer.push_back(std::to_string(i));
+
+    vector::options manual = follow;
+    manual.flush.interval = std::chrono::microseconds(0);
+    vector reader(p, manual);
+    CHECK(std::ranges::equal(reader, writer));
 
-        m_data.erase(it);
+    writer.erase(0);
+    writer.erase(10, 20);
+    writer.insert(5, "inserted");
+    writer.set(6, "set");
+    writer.push_back("last");
+    CHECK(reader.refresh() == 5);
+    CHECK(std::ranges::equal(reader, writer));
+    CHECK(reader.refresh() == 0);
+
+    bool threw = false;
+    try
+    {
+        reader.push_back("nope");
+    }
+    catch (const std::logic_error&)
+    {
+        threw = true;
     }
+    CHECK(threw);
+    CHECK(reader.refresh() == 0);
 
-    std::size_t size() const { return m_data.size(); }
+    // A polling reader catches up on its own.
+    vector polling(p, follow);
+    for (auto i = 0u; i < 100; ++i)
+        writer.push_back(std::string(i, 'x'));
+    for (auto i = 0; i < 1000 && polling.size() != writer.size(); ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    CHECK(std::ranges::equal(polling, writer));
 
-private:
-    static constexpr uint64_t PUSHBACK = 1;
-    static constexpr uint64_t ERASE = 2;
-    inline static constexpr const char* _filename = ".vector.bin";
-    std::vector<Item> m_data;
-    std::ofstream m_ofs;
-    std::uint64_t m_last_id;
+    // And follows the log into a new segment.
+    auto segments = p / "segments";
+    std::filesystem::create_directory(segments);
+    vector::options periodic;
+    periodic.flush = {.interval = std::chrono::hours(1), .bytes = 0,
+                      .records = 0};
+    vector source(segments, periodic);
+    for (auto i = 0u; i < 10; ++i)
+        source.push_back(std::string(100, 'a'), durability::sync_per_op);
+    vector tail(segments, manual);
+    CHECK(std::ranges::equal(tail, source));
 
-    // Background thread
-    std::jthread m_bg_thread;
-    std::condition_variable m_cv;
-    std::mutex m_mtx;
+    std::signal(SIGXFSZ, SIG_IGN);
+    rlimit limit;
+    getrlimit(RLIMIT_FSIZE, &limit);
+    auto lowered = limit;
+    lowered.rlim_cur = 2_KB;
+    setrlimit(RLIMIT_FSIZE, &lowered);
+    for (auto i = 0u; i < 10; ++i)
+        source.push_back(std::string(100, char('b' + i)), durability::periodic);
+    source.push_back("synced", durability::sync_per_op);
+    setrlimit(RLIMIT_FSIZE, &limit);
+    std::signal(SIGXFSZ, SIG_DFL);
+
+    CHECK(std::filesystem::exists(segments / ".vector.bin.seg1"));
+    source.erase(0);
+    source.push_back("after", durability::sync_per_op);
+    tail.refresh();
+    CHECK(std::ranges::equal(tail, source));
+}
 
-    void periodic_notify(uint64_t id)
+void run_test_twenty_four(const std::filesystem::path& p)
+{
+    auto name = "/persistent-vector-" + std::to_string(::getpid());
     {
-        if ((id & 0xFF) == 0)
+        vector v(p);
+        for (auto i = 0u; i < 100; ++i)
+            v.push_back(std::to_string(i));
+        v.share(name, 1024, 64_KB);
+
+        shared_view view(name);
+        auto equal = [&]
+        {
+            if (view.size() != v.size())
+                return false;
+            for (auto i = 0u; i < v.size(); ++i)
+                if (view.at(i) != v.at(i))
+                    return false;
+            return true;
+        };
+        CHECK(equal());
+        v.erase(0);
+        v.erase(10, 20);
+        v.insert(5, "inserted");
+        v.set(6, "set");
+        v.push_back("last");
+        CHECK(equal());
+
+        // Readers never see a torn element while many threads append.
+        v.clear();
+        CHECK(view.size() == 0);
+        std::atomic<bool> done = false;
+        std::jthread reader(
+            [&]
+            {
+                while (!done)
+                {
+                    auto n = view.size();
+                    if (n == 0)
+                        continue;
+                    auto s = view.at(n - 1);
+                    CHECK(s.find_first_not_of(s.front()) == s.npos);
+                }
+            });
+        std::vector<std::jthread> writers;
+        for (auto t = 0u; t < 4; ++t)
+            writers.emplace_back(
+                [&, t]
+                {
+                    for (auto i = 1u; i <= 100; ++i)
+                        v.push_back(std::string(i % 50 + 1, char('a' + t)));
+                });
+        writers.clear();
+        done = true;
+        reader.join();
+        CHECK(equal());
+
+        // Rewriting elements fills the arena, which is then compacted.
+        auto generation = view.generation();
+        for (auto i = 0u; i < 1000; ++i)
+            v.set(i % 100, std::string(100, char('A' + i % 26)));
+        CHECK(view.generation() > generation);
+        CHECK(equal());
+
+        // Past its capacity the mirror stops, and readers learn so.
+        for (auto i = 0u; i < 1000; ++i)
+            v.push_back(std::to_string(i));
+        bool threw = false;
+        try
+        {
+            view.size();
+        }
+        catch (const std::runtime_error&)
         {
-            m_cv.notify_all();
+            threw = true;
         }
+        CHECK(threw);
     }
-    void load_from_file(std::filesystem::path& filepath)
+    // The vector removes the shared memory with it.
+    bool threw = false;
+    try
     {
-        auto ifs = std::ifstream(filepath, std::ios::binary);
-        if (!ifs)
+        shared_view view(name);
+    }
+    catch (const std::runtime_error&)
+    {
+        threw = true;
+    }
+    CHECK(threw);
+}
+
+void run_test_twenty_five(const std::filesystem::path& p)
+{
+    // Every modification takes the next id; remember the contents after
+    // each one.
+    std::map<uint64_t, std::vector<std::string>> history;
+    {
+        vector::options opts;
+        opts.level = vector::durability::os_buffered;
+        vector v(p, opts);
+        auto record = [&]
         {
-            throw std::runtime_error("Failed to open " + filepath.string() +
-                                     " for reading.");
+            auto& contents = history[history.size() + 1];
+            for (auto item : v)
+                contents.emplace_back(item);
+        };
+        for (auto i = 0u; i < 100; ++i)
+        {
+            v.push_back(std::to_string(i));
+            record();
         }
-        // Stop loading if file has an error
-        while (true)
+        CHECK(v.checkpoint() == 100);
+        v.set(3, "set");
+        record();
+        v.insert(0, "inserted");
+        record();
+        for (auto i = 0u; i < 20; ++i)
         {
-            Header header;
-            ifs.read(reinterpret_cast<char*>(&header), sizeof(header));
-            if (!ifs)
-                break;
-
-            if (header.type == ERASE)
-            {
-                assert(m_data.at(header.rindex).id == header.id);
-                m_data.erase(m_data.begin() + header.rindex);
-            }
-            else if (header.type == PUSHBACK)
-            {
-                auto str = std::string();
-                str.resize(header.dsize);
-                ifs.read(str.data(), header.dsize);
-                if (!ifs)
-                    break;
-
-                m_data.emplace_back(header.id, str);
-            }
+            v.push_back(std::string(i, 'x'));
+            record();
+        }
+        CHECK(v.checkpoint() == 122);
+        v.erase(5);
+        record();
+        v.push_back("after erase");
+        record();
+        v.clear();
+        record();
+        for (auto i = 0u; i < 5; ++i)
+        {
+            v.push_back(std::to_string(i));
+            record();
         }
     }
-};
-
-std::size_t errors = 0;
-
-#define ERROR(msg)                                                             \
-    {                                                                          \
-        std::cout << __FILE__ << ":" << __LINE__ << " " << msg << "\n";        \
-        ++errors;                                                              \
-    }
-#define CHECK(x)                                                               \
-    do                                                                         \
-        if (!(x))                                                              \
-        {                                                                      \
-            ERROR(#x " failed");                                               \
-        }                                                                      \
-    while (false)
+    CHECK(std::filesystem::exists(p / ".vector.bin.at100"));
+    CHECK(std::filesystem::exists(p / ".vector.bin.at122"));
 
-constexpr unsigned LOOP_COUNT = 100000;
+    auto equal = [&](uint64_t id, uint64_t expected)
+    { return std::ranges::equal(vector::open_at(p, id), history[expected]); };
+    for (uint64_t id : {1, 50, 99, 100, 101, 102, 110, 124, 125, 126, 130})
+        CHECK(equal(id, id));
+    // Erases carry the id of the element, not their own; they go with the
+    // record before them.
+    CHECK(equal(122, 123));
+    CHECK(equal(1000, 130));
+    CHECK(vector::open_at(p, 0).size() == 0);
+    CHECK(std::ranges::equal(vector(p), history[130]));
 
-std::string all_chars()
-{
-    std::string rv;
-    for (char c = std::numeric_limits<char>::min();
-         c != std::numeric_limits<char>::max(); ++c)
+    // Going back to after a checkpoint does not read the log before it.
     {
-        rv += c;
+        std::fstream log(p / ".vector.bin",
+                         std::ios::in | std::ios::out | std::ios::binary);
+        log.put(0);
     }
+    CHECK(vector::open_at(p, 50).size() == 0);
+    CHECK(equal(110, 110));
+    CHECK(equal(130, 130));
 
-    rv += std::numeric_limits<char>::max();
-    return rv;
+    // The flusher writes checkpoints as the log grows.
+    auto automatic = p / "automatic";
+    std::filesystem::create_directory(automatic);
+    vector::options opts;
+    opts.flush.interval = std::chrono::milliseconds(1);
+    opts.checkpoint_bytes = 1_KB;
+    vector v(automatic, opts);
+    for (auto i = 0u; i < 200; ++i)
+        v.push_back(std::to_string(i));
+    auto checkpoints = [&]
+    {
+        auto count = 0;
+        for (auto& entry : std::filesystem::directory_iterator(automatic))
+            count += entry.path().filename().string().starts_with(
+                ".vector.bin.at");
+        return count;
+    };
+    for (auto i = 0; i < 1000 && checkpoints() == 0; ++i)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    CHECK(checkpoints() > 0);
+    auto past = vector::open_at(automatic, 150);
+    CHECK(past.size() == 150);
+    CHECK(past.at(149) == "149");
 }
 
-std::string chars_4K(char v)
+void run_test_twenty_six(const std::filesystem::path& p)
 {
-    std::string rv(4_KB, v);
-    return rv;
-}
+    auto log = p / ".vector.bin";
+    std::vector<std::string> before;
+    std::vector<std::string> after;
+    {
+        vector::options opts;
+        opts.level = vector::durability::os_buffered;
+        vector v(p, opts);
+        for (auto i = 0u; i < 10; ++i)
+            v.push_back(std::to_string(i));
+        for (auto item : v)
+            before.emplace_back(item);
+        vector::options follow;
+        follow.read_only = true;
+        follow.flush.interval = std::chrono::microseconds(0);
+        vector reader(p, follow);
 
-void run_test_one(const std::filesystem::path& p)
-{
-    vector v(p);
-    using namespace std::literals;
+        // A bad index anywhere leaves both the vector and the log alone.
+        auto size = std::filesystem::file_size(log);
+        auto bad = v.begin_transaction();
+        bad.push_back("a");
+        bad.erase(11);
+        bool threw = false;
+        try
+        {
+            bad.commit();
+        }
+        catch (const std::out_of_range&)
+        {
+            threw = true;
+        }
+        CHECK(threw);
+        CHECK(std::ranges::equal(v, before));
+        CHECK(std::filesystem::file_size(log) == size);
 
-    v.push_back("foo");
-    CHECK(v.at(0) == "foo");
-    CHECK(v.size() == 1);
+        auto tx = v.begin_transaction();
+        tx.push_back("a");
+        tx.insert(0, "b");
+        tx.set(1, "c");
+        tx.erase(2);
+        tx.erase(3, 5);
+        tx.erase(4, 4);
+        tx.push_back("d");
+        CHECK(std::ranges::equal(v, before));
+        tx.commit(vector::durability::sync_per_op);
 
-    v.push_back(all_chars());
-    CHECK(v.at(1) == all_chars());
-    CHECK(v.size() == 2);
+        after = before;
+        after.push_back("a");
+        after.insert(after.begin(), "b");
+        after[1] = "c";
+        after.erase(after.begin() + 2);
+        after.erase(after.begin() + 3, after.begin() + 5);
+        after.push_back("d");
+        CHECK(std::ranges::equal(v, after));
+        CHECK(reader.refresh() == 1);
+        CHECK(std::ranges::equal(reader, after));
 
-    auto start = std::chrono::system_clock::now();
-    for (auto i = 0u; i < LOOP_COUNT; ++i)
-    {
-        std::stringstream s;
-        s << "loop " << i;
-        v.push_back(s.str());
+        threw = false;
+        try
+        {
+            tx.commit();
+        }
+        catch (const std::logic_error&)
+        {
+            threw = true;
+        }
+        CHECK(threw);
+
+        auto cleared = v.begin_transaction();
+        cleared.clear();
+        cleared.push_back("only");
+        cleared.commit();
+        CHECK(v.size() == 1);
+        CHECK(v.at(0) == "only");
     }
-    auto end = std::chrono::system_clock::now();
-    std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(end -
-                                                                       start)
-                     .count()
-              << " ms" << std::endl;
-    CHECK((end - start) / 1s < 1);
-    CHECK(v.size() == LOOP_COUNT + 2);
+    CHECK(std::ranges::equal(vector(p), std::vector<std::string>{"only"}));
+
+    // A transaction cut short by a crash is dropped as a whole.
+    auto size = std::filesystem::file_size(log);
+    std::filesystem::resize_file(log, size - 1);
+    CHECK(std::ranges::equal(vector(p), after));
 }
 
-void run_test_two(const std::filesystem::path& p)
+void run_test_twenty_seven(const std::filesystem::path& p)
 {
-    vector v(p);
+    constexpr std::size_t count = 1000;
+    {
+        vector v(p);
+        CHECK(!v.try_push_back(1, "too far"));
+        CHECK(v.try_push_back(0, "0"));
+        CHECK(!v.try_push_back(0, "taken"));
+        v.erase(0);
+        CHECK(v.try_push_back(0, "0"));
 
-    CHECK(v.size() == LOOP_COUNT + 2);
-    CHECK(v.at(0) == "foo");
-    CHECK(v.at(1) == all_chars());
-    CHECK(v.at(873) == "loop 871");
+        // Every element lands exactly at the index its writer saw.
+        std::vector<std::jthread> threads;
+        for (auto t = 0u; t < 4; ++t)
+            threads.emplace_back(
+                [&]
+                {
+                    while (true)
+                    {
+                        auto n = v.size();
+                        if (n >= count)
+                            break;
+                        v.try_push_back(n, std::to_string(n));
+                    }
+                });
+        threads.clear();
+        CHECK(v.size() == count);
+        for (auto i = 0u; i < count; ++i)
+            CHECK(v.at(i) == std::to_string(i));
 
-    v.erase(873);
-    CHECK(v.size() == LOOP_COUNT + 1);
-    CHECK(v.at(0) == "foo");
-    CHECK(v.at(1) == all_chars());
-    CHECK(v.at(873) == "loop 872");
+        // Plain appends and erases move the expected size on.
+        v.push_back("plain");
+        CHECK(!v.try_push_back(count, "stale"));
+        CHECK(v.try_push_back(count + 1, "fresh"));
+        v.erase(0, 10);
+        CHECK(!v.try_push_back(count + 2, "stale"));
+        CHECK(v.try_push_back(count - 8, "after erase"));
+    }
+
+    vector v(p);
+    CHECK(v.size() == count - 7);
+    CHECK(v.at(0) == "10");
+    CHECK(v.at(count - 10) == "plain");
+    CHECK(v.at(count - 8) == "after erase");
 }
 
-void run_test_three(const std::filesystem::path& p)
+void run_test_twenty_eight(const std::filesystem::path& p)
 {
-    vector v(p);
+    using durability = vector::durability;
+    {
+        vector v(p);
+        CHECK(v.push_back(1, "a"));
+        CHECK(!v.push_back(1, "a"));
+        CHECK(!v.push_back(1, "a", durability::sync_per_op));
+        CHECK(v.push_back(2, "b"));
+        v.push_back("untokened");
+        CHECK(v.size() == 3);
 
-    CHECK(v.size() == LOOP_COUNT + 1);
-    CHECK(v.at(0) == "foo");
-    CHECK(v.at(1) == all_chars());
-    CHECK(v.at(873) == "loop 872");
+        // Retries racing each other still append once per token.
+        std::vector<std::jthread> threads;
+        for (auto t = 0u; t < 4; ++t)
+            threads.emplace_back(
+                [&]
+                {
+                    for (auto token = 100u; token < 600; ++token)
+                        v.push_back(token, std::to_string(token));
+                });
+        threads.clear();
+        CHECK(v.size() == 503);
+        std::vector<std::string> tokens;
+        for (auto i = 3u; i < v.size(); ++i)
+            tokens.emplace_back(v.at(i));
+        std::ranges::sort(tokens);
+        CHECK(std::ranges::adjacent_find(tokens) == tokens.end());
+    }
+    {
+        // The tokens come back with the log.
+        vector v(p);
+        CHECK(!v.push_back(1, "a"));
+        CHECK(!v.push_back(599, "599"));
+        CHECK(v.push_back(3, "c"));
+        CHECK(v.size() == 504);
+    }
 
-    v.erase(873);
-    CHECK(v.size() == LOOP_COUNT);
-    CHECK(v.at(0) == "foo");
-    CHECK(v.at(1) == all_chars());
-    CHECK(v.at(873) == "loop 873");
+    // Only the latest tokens are remembered.
+    auto small = p / "small";
+    std::filesystem::create_directory(small);
+    vector::options opts;
+    opts.dedup_window = 4;
+    {
+        vector v(small, opts);
+        for (auto token = 10u; token < 16; ++token)
+            CHECK(v.push_back(token, std::to_string(token)));
+        CHECK(!v.push_back(15, "15"));
+        CHECK(v.push_back(10, "10 again"));
+    }
+    vector v(small, opts);
+    CHECK(!v.push_back(10, "10"));
+    CHECK(!v.push_back(13, "13"));
+    CHECK(v.push_back(11, "11 again"));
+    CHECK(v.size() == 8);
 }
 
-void run_test_four(const std::filesystem::path& p)
+void run_test_twenty_nine(const std::filesystem::path& p)
 {
-    vector v(p);
-    using namespace std::literals;
-
-    while (auto i = v.size())
+    using durability = vector::durability;
+    vector::options opts;
+    opts.queue = true;
+    opts.segment_bytes = 4_KB;
+    opts.flush.interval = std::chrono::milliseconds(1);
+    auto payload = [](int i)
+    { return std::string(100, 'x') + std::to_string(i); };
     {
-        v.erase(i - 1);
-    }
+        vector q(p, opts);
+        CHECK(!q.pop_front());
+        for (auto i = 0; i < 10; ++i)
+            q.push_back(std::to_string(i));
+        CHECK(q.pop_front() == "0");
+        CHECK(q.pop_front() == "1");
+        CHECK(q.size() == 8);
+        CHECK(q.at(0) == "2");
+        CHECK(*q.begin() == "2");
 
-    auto start = std::chrono::system_clock::now();
-    for (auto i = 0u; i < LOOP_COUNT; ++i)
+        bool threw = false;
+        try
+        {
+            q.insert(0, "nope");
+        }
+        catch (const std::logic_error&)
+        {
+            threw = true;
+        }
+        CHECK(threw);
+
+        // A snapshot keeps what a later pop removes.
+        auto s = q.snapshot();
+        CHECK(q.pop_front() == "2");
+        CHECK(s.size() == 8);
+        CHECK(s.at(0) == "2");
+        CHECK(q.at(0) == "3");
+
+        CHECK(q.try_push_back(7, "10"));
+        CHECK(!q.try_push_back(7, "11"));
+        for (auto i = 3; i <= 10; ++i)
+            CHECK(q.pop_front() == std::to_string(i));
+        CHECK(!q.pop_front());
+
+        // Consumed segments are deleted once the flusher logs the head.
+        for (auto i = 0; i < 10000; ++i)
+            q.push_back(payload(i));
+        for (auto i = 0; i < 9000; ++i)
+            CHECK(q.pop_front() == payload(i));
+        CHECK(q.size() == 1000);
+        CHECK(q.at(0) == payload(9000));
+        for (auto i = 0;
+             i < 1000 && std::filesystem::exists(p / ".vector.bin"); ++i)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        CHECK(!std::filesystem::exists(p / ".vector.bin"));
+    }
     {
-        v.push_back(chars_4K(i));
-        CHECK(v.at(i) == chars_4K(i));
-        CHECK(v.size() == i + 1);
+        vector q(p, opts);
+        CHECK(q.size() == 1000);
+        CHECK(q.at(999) == payload(9999));
+        CHECK(q.pop_front(durability::sync_per_op) == payload(9000));
     }
-    auto end = std::chrono::system_clock::now();
-    std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(end -
-                                                                       start)
-                     .count()
-              << " ms" << std::endl;
-    CHECK((end - start) / 1s < 1);
-    CHECK(v.size() == LOOP_COUNT);
+    vector q(p, opts);
+    CHECK(q.size() == 999);
+    CHECK(q.pop_front() == payload(9001));
 }
 
 int main(int argc, char**)
@@ -397,6 +5579,81 @@ int main(int argc, char**)
     run_test_three(data_dir);
     run_test_four(data_dir);
 
+    std::filesystem::create_directory(data_dir / "five");
+    run_test_five(data_dir / "five");
+
+    std::filesystem::create_directory(data_dir / "six");
+    run_test_six(data_dir / "six");
+
+    std::filesystem::create_directory(data_dir / "seven");
+    run_test_seven(data_dir / "seven");
+
+    std::filesystem::create_directory(data_dir / "eight");
+    run_test_eight(data_dir / "eight");
+
+    std::filesystem::create_directory(data_dir / "nine");
+    run_test_nine(data_dir / "nine");
+
+    std::filesystem::create_directory(data_dir / "ten");
+    run_test_ten(data_dir / "ten");
+
+    std::filesystem::create_directory(data_dir / "eleven");
+    run_test_eleven(data_dir / "eleven");
+
+    std::filesystem::create_directory(data_dir / "twelve");
+    run_test_twelve(data_dir / "twelve");
+
+    std::filesystem::create_directory(data_dir / "thirteen");
+    run_test_thirteen(data_dir / "thirteen");
+
+    std::filesystem::create_directory(data_dir / "fourteen");
+    run_test_fourteen(data_dir / "fourteen");
+
+    std::filesystem::create_directory(data_dir / "fifteen");
+    run_test_fifteen(data_dir / "fifteen");
+
+    std::filesystem::create_directory(data_dir / "sixteen");
+    run_test_sixteen(data_dir / "sixteen");
+
+    std::filesystem::create_directory(data_dir / "seventeen");
+    run_test_seventeen(data_dir / "seventeen");
+
+    std::filesystem::create_directory(data_dir / "eighteen");
+    run_test_eighteen(data_dir / "eighteen");
+
+    std::filesystem::create_directory(data_dir / "nineteen");
+    run_test_nineteen(data_dir / "nineteen");
+
+    std::filesystem::create_directory(data_dir / "twenty");
+    run_test_twenty(data_dir / "twenty");
+
+    std::filesystem::create_directory(data_dir / "twenty_one");
+    run_test_twenty_one(data_dir / "twenty_one");
+
+    std::filesystem::create_directory(data_dir / "twenty_two");
+    run_test_twenty_two(data_dir / "twenty_two");
+
+    std::filesystem::create_directory(data_dir / "twenty_three");
+    run_test_twenty_three(data_dir / "twenty_three");
+
+    std::filesystem::create_directory(data_dir / "twenty_four");
+    run_test_twenty_four(data_dir / "twenty_four");
+
+    std::filesystem::create_directory(data_dir / "twenty_five");
+    run_test_twenty_five(data_dir / "twenty_five");
+
+    std::filesystem::create_directory(data_dir / "twenty_six");
+    run_test_twenty_six(data_dir / "twenty_six");
+
+    std::filesystem::create_directory(data_dir / "twenty_seven");
+    run_test_twenty_seven(data_dir / "twenty_seven");
+
+    std::filesystem::create_directory(data_dir / "twenty_eight");
+    run_test_twenty_eight(data_dir / "twenty_eight");
+
+    std::filesystem::create_directory(data_dir / "twenty_nine");
+    run_test_twenty_nine(data_dir / "twenty_nine");
+
     if (errors != 0)
     {
         std::cout << "tests were failing\n";